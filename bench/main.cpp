@@ -0,0 +1,349 @@
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include "coroutines/coroutines.h"
+#include "coroutines/fcontext/fcontext.h"
+
+using namespace Coroutines;
+
+// ---------------------------------------------------------------
+// Microbenchmarks of the library. Each result is a csv line:
+//   benchmark,param,ops,ns_per_op,ops_per_sec
+// so two runs can be compared with any diff tool. Lines starting with #
+// are comments. An optional argument runs only the benchmarks whose
+// name contains it.
+// Configure with -DCMAKE_BUILD_TYPE=RelWithDebInfo to measure the
+// optimized library.
+// ---------------------------------------------------------------
+
+// The library reports some errors through it
+void dbg(const char *fmt, ...) {
+}
+
+static const char* filter = nullptr;
+
+static bool enabled(const char* name) {
+  return !filter || strstr(name, filter) != nullptr;
+}
+
+static void report(const char* name, const char* param, uint64_t ops, TTimeDelta elapsed) {
+  double ns = (double)elapsed.count();
+  printf("%s,%s,%llu,%.1f,%.0f\n", name, param, (unsigned long long)ops,
+    ns / (double)ops, ns > 0 ? (double)ops * 1e9 / ns : 0.0);
+  fflush(stdout);
+}
+
+// ---------------------------------------------------------------
+// Cost of jump_fcontext alone, between two contexts bouncing each other
+static void bounceFn(fcontext_transfer_t t) {
+  while (true)
+    t = jump_fcontext(t.ctx, nullptr);
+}
+
+void benchRawSwitch() {
+  if (!enabled("fcontext_switch"))
+    return;
+  const uint64_t num_jumps = 2000000;
+  fcontext_stack_t stack = create_fcontext_stack(64 * 1024);
+  fcontext_t ctx = make_fcontext(stack.sptr, stack.ssize, &bounceFn);
+  TScopedTime tm;
+  for (uint64_t i = 0; i < num_jumps / 2; ++i)
+    ctx = jump_fcontext(ctx, nullptr).ctx;
+  report("fcontext_switch", "-", num_jumps, tm.elapsed());
+  destroy_fcontext_stack(&stack);
+}
+
+// ---------------------------------------------------------------
+// A coroutine started from the main thread runs until it blocks, the
+// ones started from other coroutine are queued. Those are started in
+// batches, so the stacks alive stay below the limits of the OS
+void benchSpawn() {
+  if (!enabled("spawn_exit"))
+    return;
+  const uint64_t num_coros = 200000;
+  const uint64_t batch_size = 1000;
+  {
+    TScopedTime tm;
+    for (uint64_t i = 0; i < num_coros; ++i)
+      start([]() {});
+    report("spawn_exit", "from_main", num_coros, tm.elapsed());
+  }
+  {
+    TScopedTime tm;
+    start([num_coros, batch_size]() {
+      for (uint64_t i = 0; i < num_coros; i += batch_size) {
+        THandle last;
+        for (uint64_t n = 0; n < batch_size; ++n)
+          last = start([]() {});
+        wait(TWatchedEvent(last));
+      }
+    });
+    run();
+    report("spawn_exit", "from_coroutine", num_coros, tm.elapsed());
+  }
+}
+
+// ---------------------------------------------------------------
+// Time of a round trip ping -> pong
+void benchPingPong() {
+  if (!enabled("channel_pingpong"))
+    return;
+  const uint64_t num_round_trips = 200000;
+  for (size_t capacity : { 0, 1, 64 }) {
+    auto ping = TTypedChannel<int>::create(capacity);
+    auto pong = TTypedChannel<int>::create(capacity);
+    TScopedTime tm;
+    start([&]() {
+      int v;
+      while (v << ping)
+        pong << v;
+    });
+    start([&]() {
+      for (uint64_t i = 0; i < num_round_trips; ++i) {
+        int v;
+        ping << (int)i;
+        v << pong;
+      }
+      close(ping);
+    });
+    run();
+    char param[32];
+    snprintf(param, sizeof(param), "capacity=%d", (int)capacity);
+    report("channel_pingpong", param, num_round_trips, tm.elapsed());
+    destroy(ping);
+    destroy(pong);
+  }
+}
+
+// ---------------------------------------------------------------
+// One producer and one consumer, per message
+void benchThroughput() {
+  if (!enabled("channel_throughput"))
+    return;
+  const uint64_t num_msgs = 1000000;
+  for (size_t capacity : { 0, 1, 16, 256, 4096 }) {
+    auto ch = TTypedChannel<int>::create(capacity);
+    uint64_t received = 0;
+    TScopedTime tm;
+    start([&]() {
+      int v;
+      while (v << ch)
+        ++received;
+    });
+    start([&]() {
+      for (uint64_t i = 0; i < num_msgs; ++i)
+        ch << (int)i;
+      close(ch);
+    });
+    run();
+    assert(received == num_msgs);
+    char param[32];
+    snprintf(param, sizeof(param), "capacity=%d", (int)capacity);
+    report("channel_throughput", param, num_msgs, tm.elapsed());
+    destroy(ch);
+  }
+}
+
+// ---------------------------------------------------------------
+// A consumer choosing between 4 producers, per message received
+void benchChooseFanIn() {
+  if (!enabled("choose_fanin"))
+    return;
+  const int num_producers = 4;
+  const uint64_t msgs_per_producer = 100000;
+  std::vector< TTypedChannel<int> > chs;
+  for (int i = 0; i < num_producers; ++i)
+    chs.push_back(TTypedChannel<int>::create(16));
+
+  uint64_t received = 0;
+  TScopedTime tm;
+  for (int i = 0; i < num_producers; ++i) {
+    start([&, i]() {
+      for (uint64_t n = 0; n < msgs_per_producer; ++n)
+        chs[i] << (int)n;
+    });
+  }
+  start([&]() {
+    auto on_msg = [&](int) { ++received; };
+    while (received < num_producers * msgs_per_producer) {
+      choose(
+        ifCanRead(chs[0], on_msg)
+      , ifCanRead(chs[1], on_msg)
+      , ifCanRead(chs[2], on_msg)
+      , ifCanRead(chs[3], on_msg)
+      );
+    }
+  });
+  run();
+  report("choose_fanin", "producers=4", received, tm.elapsed());
+  for (auto& ch : chs)
+    destroy(ch);
+}
+
+// ---------------------------------------------------------------
+// A consumer of 1000 channels, each with its own producer. Per message
+// received, with a selector and with wait over an array of events
+void benchSelectorFanIn() {
+  if (!enabled("selector_fanin"))
+    return;
+  const int num_channels = 1000;
+  const int msgs_per_channel = 100;
+  for (int use_selector = 0; use_selector < 2; ++use_selector) {
+    std::vector< TTypedChannel<int> > chs;
+    for (int i = 0; i < num_channels; ++i)
+      chs.push_back(TTypedChannel<int>::create(4));
+
+    uint64_t received = 0;
+    TScopedTime tm;
+    for (auto ch : chs) {
+      start([ch]() {
+        for (int n = 0; n < msgs_per_channel; ++n)
+          ch << n;
+        close(ch);
+      });
+    }
+    start([&]() {
+      int v;
+      if (use_selector) {
+        TSelector selector;
+        for (auto ch : chs)
+          selector.add(canRead(ch));
+        while (selector.size()) {
+          int id = selector.select();
+          if (v << chs[id]) {
+            ++received;
+          }
+          else {
+            selector.remove(id);
+            destroy(chs[id]);
+          }
+        }
+      }
+      else {
+        std::vector< TWatchedEvent > wes;
+        for (auto ch : chs)
+          wes.push_back(canRead(ch));
+        while (!wes.empty()) {
+          int idx = wait(wes.data(), (int)wes.size());
+          if (v << chs[idx]) {
+            ++received;
+          }
+          else {
+            destroy(chs[idx]);
+            wes.erase(wes.begin() + idx);
+            chs.erase(chs.begin() + idx);
+          }
+        }
+      }
+    });
+    run();
+    report("selector_fanin", use_selector ? "selector" : "wait_array", received, tm.elapsed());
+  }
+}
+
+// ---------------------------------------------------------------
+// Two coroutines waking each other with user events, per wake up
+void benchEventWakeUp() {
+  if (!enabled("event_wakeup"))
+    return;
+  const uint64_t num_round_trips = 200000;
+  TEventID ping = createEvent();
+  TEventID pong = createEvent();
+  TScopedTime tm;
+  start([&]() {
+    for (uint64_t i = 0; i < num_round_trips; ++i) {
+      wait(TWatchedEvent(ping));
+      clearEvent(ping);
+      setEvent(pong);
+    }
+  });
+  start([&]() {
+    for (uint64_t i = 0; i < num_round_trips; ++i) {
+      setEvent(ping);
+      wait(TWatchedEvent(pong));
+      clearEvent(pong);
+    }
+  });
+  run();
+  report("event_wakeup", "-", 2 * num_round_trips, tm.elapsed());
+  destroyEvent(ping);
+  destroyEvent(pong);
+}
+
+// ---------------------------------------------------------------
+// The timers alone, without coroutines sleeping on them. Nobody owns the
+// events, so firing them doesn't wake up anyone
+void benchTimeouts() {
+  if (!enabled("timeouts"))
+    return;
+  internal::TSchedLock lock;
+  for (uint64_t num_timers : { 1000, 100000, 1000000 }) {
+    char param[32];
+    snprintf(param, sizeof(param), "timers=%d", (int)num_timers);
+
+    // Spread between 1 and 10 ms
+    uint32_t seed = 12345;
+    std::vector< TWatchedEvent > wes;
+    wes.reserve(num_timers);
+    for (uint64_t i = 0; i < num_timers; ++i) {
+      seed = seed * 1664525 + 1013904223;
+      wes.emplace_back(Time::MilliSecond + (seed >> 8) % 9000 * Time::MicroSecond);
+    }
+
+    {
+      TScopedTime tm;
+      for (auto& we : wes)
+        internal::registerTimeoutEvent(&we);
+      report("timeouts_insert", param, num_timers, tm.elapsed());
+    }
+    {
+      std::this_thread::sleep_for(12 * Time::MilliSecond);
+      TScopedTime tm;
+      internal::checkTimeoutEvents();
+      report("timeouts_expire", param, num_timers, tm.elapsed());
+    }
+    {
+      for (auto& we : wes) {
+        we = TWatchedEvent(Time::Second);
+        internal::registerTimeoutEvent(&we);
+      }
+      TScopedTime tm;
+      for (auto& we : wes)
+        internal::unregisterTimeoutEvent(&we);
+      report("timeouts_cancel", param, num_timers, tm.elapsed());
+    }
+  }
+}
+
+// ---------------------------------------------------------------
+// Cost of recording one event while tracing
+void benchTraceRecord() {
+  if (!enabled("trace_record"))
+    return;
+  const uint64_t num_events = 4000000;
+  Trace::start(1 << 16);
+  TScopedTime tm;
+  for (uint64_t i = 0; i < num_events; ++i)
+    internal::trace(internal::TRACE_RESUME, THandle(), EVT_INVALID, i);
+  report("trace_record", "-", num_events, tm.elapsed());
+  Trace::stop();
+}
+
+// ---------------------------------------------------------------
+int main(int argc, char** argv) {
+  if (argc > 1)
+    filter = argv[1];
+
+  printf("# benchmark,param,ops,ns_per_op,ops_per_sec\n");
+  benchRawSwitch();
+  benchSpawn();
+  benchPingPong();
+  benchThroughput();
+  benchChooseFanIn();
+  benchSelectorFanIn();
+  benchEventWakeUp();
+  benchTimeouts();
+  benchTraceRecord();
+  return 0;
+}
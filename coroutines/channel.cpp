@@ -1,4 +1,6 @@
 #include "coroutines.h"
+#include "segmented_table.h"
+#include <mutex>
 
 namespace Coroutines {
 
@@ -6,28 +8,139 @@ namespace Coroutines {
   namespace internal {
 
     // -------------------------------------------------------------
-    // Container of all real channels objectss
-    std::vector<TBaseChan*> all_channels;
+    // Channels are small and can be created at a high rate, like a timer
+    // per request. They are carved from blocks of 64Kb, and the released
+    // ones are kept in a free list per size class. The bigger ones, like
+    // static channels with a large ring, go to the heap
+    class TChanSlab {
+      static const size_t granularity = 32;
+      static const size_t num_classes = 16;
+      static const size_t block_size = 64 * 1024;
+
+      struct TFreeObj {
+        TFreeObj* next;
+      };
+
+      TFreeObj*                              free_objs[num_classes] = {};
+      std::vector< std::unique_ptr<char[]> > blocks;
+      char*                                  block_top = nullptr;
+      size_t                                 block_left = 0;
+
+      static size_t classOf(size_t nbytes) { return (nbytes + granularity - 1) / granularity - 1; }
+
+    public:
+
+      void* alloc(size_t nbytes) {
+        size_t cls = classOf(nbytes);
+        if (cls >= num_classes)
+          return ::operator new(nbytes);
+        if (auto obj = free_objs[cls]) {
+          free_objs[cls] = obj->next;
+          return obj;
+        }
+        size_t obj_size = (cls + 1) * granularity;
+        if (block_left < obj_size) {
+          blocks.emplace_back(new char[block_size]);
+          block_top = blocks.back().get();
+          block_left = block_size;
+        }
+        void* obj = block_top;
+        block_top += obj_size;
+        block_left -= obj_size;
+        return obj;
+      }
+
+      void free(void* p, size_t nbytes) {
+        size_t cls = classOf(nbytes);
+        if (cls >= num_classes) {
+          ::operator delete(p);
+          return;
+        }
+        auto obj = (TFreeObj*)p;
+        obj->next = free_objs[cls];
+        free_objs[cls] = obj;
+      }
+    };
+
+    TChanSlab chan_slab;
+
+    // Guards the slab and the changes in the registry. MPMC channels can be
+    // created by plain threads, which don't take the sched lock unless the
+    // scheduler is multithreaded. Lookups don't take it
+    std::mutex chan_registry_mutex;
+
+    void* TBaseChan::operator new(size_t nbytes) {
+      std::lock_guard< std::mutex > guard(chan_registry_mutex);
+      return chan_slab.alloc(nbytes);
+    }
+
+    void TBaseChan::operator delete(void* p, size_t nbytes) {
+      std::lock_guard< std::mutex > guard(chan_registry_mutex);
+      chan_slab.free(p, nbytes);
+    }
+
+    // -------------------------------------------------------------
+    // Slots of the registered channels. Released slots are reused with
+    // a new age, so the handles of the previous channel become stale.
+    // chan is published once the handle of the channel is set
+    struct TChanSlot {
+      std::atomic< TBaseChan* > chan{ nullptr };
+      uint32_t                  age = 0;
+    };
+    TSegmentedTable< TChanSlot > chan_slots;
+    std::vector< uint32_t >      free_chan_slots;
+
+    // The bits of TChanHandle::age
+    static const uint32_t max_chan_age = (1u << 28) - 1;
 
     // -------------------------------------------------------------
     TChanHandle registerChannel(TBaseChan* c, TChanHandle::eClassID channel_type) {
-      // Right now add it to the end...
-      all_channels.push_back(c);
-      c->handle = TChanHandle(channel_type, (int32_t)all_channels.size() - 1);
+      std::lock_guard< std::mutex > guard(chan_registry_mutex);
+      uint32_t idx;
+      if (free_chan_slots.empty()) {
+        idx = chan_slots.size();
+        assert(idx != UINT32_MAX);
+        chan_slots.grow();
+      }
+      else {
+        idx = free_chan_slots.back();
+        free_chan_slots.pop_back();
+      }
+      auto& slot = chan_slots[idx];
+      // Age 0 is never used, so the default handle is always invalid
+      slot.age = (slot.age + 1) & max_chan_age;
+      if (!slot.age)
+        slot.age = 1;
+      c->handle = TChanHandle(channel_type, idx, slot.age);
+      slot.chan.store(c, std::memory_order_release);
       return c->handle;
     }
 
+    void unregisterChannel(TBaseChan* c) {
+      std::lock_guard< std::mutex > guard(chan_registry_mutex);
+      auto& slot = chan_slots[c->handle.index];
+      assert(slot.chan.load(std::memory_order_relaxed) == c);
+      slot.chan.store(nullptr, std::memory_order_relaxed);
+      free_chan_slots.push_back(c->handle.index);
+    }
+
     // -------------------------------------------------------------
     TBaseChan* TBaseChan::findChannelByHandle(TChanHandle h) {
 
       // The channel id is valid?
-      if (h.index >= all_channels.size())
+      if (h.index >= chan_slots.size())
         return nullptr;
 
-      auto c = all_channels[h.index];
-      assert(c);
+      auto c = chan_slots[h.index].chan.load(std::memory_order_acquire);
+      return (c && c->handle == h) ? c : nullptr;
+    }
 
-      return (c->handle == h) ? c : nullptr;
+    // -------------------------------------------------------------
+    void TBaseChan::releaseIfDone() {
+      if (num_users || !canBeReleased())
+        return;
+      unregisterChannel(this);
+      delete this;
     }
   
     // ------------------------------------------------------------
@@ -56,6 +169,72 @@ namespace Coroutines {
       return false;
     }
 
+    // ------------------------------------------------------------
+    struct TPostedWakeUp {
+      TChanHandle handle;
+      eEventType  event_type;
+      bool        wake_all;
+    };
+    std::mutex                    posted_mutex;
+    std::vector< TPostedWakeUp >  posted_wake_ups;
+    std::vector< TBaseChan* >     posted_retires;
+    std::atomic<bool>             has_posted_wake_ups{ false };
+
+    void postChannelWakeUp(TChanHandle h, eEventType event_type, bool wake_all) {
+      {
+        std::lock_guard< std::mutex > guard(posted_mutex);
+        posted_wake_ups.push_back({ h, event_type, wake_all });
+        has_posted_wake_ups = true;
+      }
+      // The loop might be sleeping in the io backend
+      io_events.interrupt();
+    }
+
+    // Channels owned by their handles are deleted by whoever drops the
+    // last handle, which can be any thread
+    void retireChannel(TBaseChan* c) {
+      if (canWakeUpFromThisThread()) {
+        TSchedLock lock;
+        unregisterChannel(c);
+        delete c;
+        return;
+      }
+      {
+        std::lock_guard< std::mutex > guard(posted_mutex);
+        posted_retires.push_back(c);
+        has_posted_wake_ups = true;
+      }
+      io_events.interrupt();
+    }
+
+    void deliverPostedWakeUps() {
+      if (!has_posted_wake_ups)
+        return;
+      std::vector< TPostedWakeUp > wake_ups;
+      std::vector< TBaseChan* > retires;
+      {
+        std::lock_guard< std::mutex > guard(posted_mutex);
+        wake_ups.swap(posted_wake_ups);
+        retires.swap(posted_retires);
+        has_posted_wake_ups = false;
+      }
+      for (auto& w : wake_ups) {
+        auto c = TBaseChan::findChannelByHandle(w.handle);
+        if (!c)
+          continue;
+        bool to_pull = (w.event_type == EVT_CHANNEL_CAN_PULL);
+        do {
+          bool woken = to_pull ? c->detachOneWaitingForPull() : c->detachOneWaitingForPush();
+          if (!woken)
+            break;
+        } while (w.wake_all);
+      }
+      for (auto c : retires) {
+        unregisterChannel(c);
+        delete c;
+      }
+    }
+
   }
 
   // -------------------------------------------------------------
@@ -65,8 +244,15 @@ namespace Coroutines {
     TTimeStamp next;
     TTimeDelta interval;
     bool       is_periodic = false;
+    bool       has_fired = false;
+
+    // Nobody can pull a one shot timer again once it has fired, so it goes
+    // away when the last coroutine using it leaves
+    bool canBeReleased() const override { return is_destroyed || has_fired; }
+
     void prepareNext() {
       if (!is_periodic) {
+        has_fired = true;
         close();
         return;
       }
@@ -117,25 +303,31 @@ namespace Coroutines {
   };
 
   TTimeHandle every(TTimeDelta interval_time) {
+    internal::TSchedLock lock;
     TTimeChan* c = new TTimeChan(interval_time, true);
     return internal::registerChannel(c, TChanHandle::eClassID::CT_TIMER);
   }
 
   TTimeHandle after(TTimeDelta interval_time) {
+    internal::TSchedLock lock;
     TTimeChan* c = new TTimeChan(interval_time, false);
     return internal::registerChannel(c, TChanHandle::eClassID::CT_TIMER);
   }
 
   bool operator<<(TTimeStamp& value, TTimeHandle cid) {
+    internal::TSchedLock lock;
     auto c = internal::TBaseChan::findChannelByHandle(cid);
     if (!c || c->closed())
       return false;
     assert(cid.class_id == TChanHandle::eClassID::CT_TIMER);
+    // The timer might be destroyed while we sleep inside
+    internal::TChanUse use(c);
     TTimeChan* tc = (TTimeChan*)c;
     return tc->pullTime(value);
   }
 
   TTimeDelta TTimeHandle::timeForNextEvent() const {
+    internal::TSchedLock lock;
     auto c = internal::TBaseChan::findChannelByHandle(*this);
     if (!c || c->closed())
       return TTimeDelta::zero();
@@ -153,6 +345,7 @@ namespace Coroutines {
   // -------------------------------------------------------
   // -------------------------------------------------------
   bool close(TChanHandle cid) {
+    internal::TSchedLock lock;
     auto c = internal::TBaseChan::findChannelByHandle(cid);
     if (!c || c->closed())
       return false;
@@ -160,7 +353,17 @@ namespace Coroutines {
     return true;
   }
 
+  bool destroy(TChanHandle cid) {
+    internal::TSchedLock lock;
+    auto c = internal::TBaseChan::findChannelByHandle(cid);
+    if (!c)
+      return false;
+    c->destroy();
+    return true;
+  }
+
   bool isChannel(TChanHandle cid) {
+    internal::TSchedLock lock;
     auto c = internal::TBaseChan::findChannelByHandle(cid);
     return c != nullptr;
   }
@@ -2,6 +2,9 @@
 #define INC_COROUTINES_CHANNEL_H_
 
 #include <cinttypes>
+#include <atomic>
+#include <algorithm>
+#include <memory>
 #include "coroutines.h"
 
 namespace Coroutines {
@@ -9,14 +12,28 @@ namespace Coroutines {
   // -------------------------------------------------------------
   namespace internal {
 
+    // Implemented in coroutines.cpp
+    bool runsInSharedStack();
+
     // --------------------------------------------------------------
     class TBaseChan {
     protected:
-      bool         is_closed = false;
+      std::atomic<bool> is_closed{ false };
+
+      // Coroutines inside an operation of the channel, plus the slots
+      // given by reserve/peek. The channel is not released while in use
+      int          num_users = 0;
+      bool         is_destroyed = false;
 
       bool         detachOneWaitingForPull();
       bool         detachOneWaitingForPush();
 
+      // Only destroy() releases the channel. A closed channel keeps its
+      // handle valid, so it can still be drained and waited on
+      virtual bool canBeReleased() const { return is_destroyed; }
+
+      friend void  deliverPostedWakeUps();
+
     public:
 
       TChanHandle  handle;
@@ -25,6 +42,26 @@ namespace Coroutines {
 
       virtual ~TBaseChan() {}
 
+      // Channel objects come from a slab, guarded by the mutex of the registry
+      static void* operator new(size_t nbytes);
+      static void  operator delete(void* p, size_t nbytes);
+
+      void enter() { ++num_users; }
+      void leave() {
+        assert(num_users > 0);
+        --num_users;
+        releaseIfDone();
+      }
+
+      // Frees the slot of the handle and the object once nobody uses it
+      void releaseIfDone();
+
+      void destroy() {
+        is_destroyed = true;
+        close();
+        releaseIfDone();
+      }
+
       void close() {
 
         is_closed = true;
@@ -41,60 +78,251 @@ namespace Coroutines {
       virtual bool empty() const { return true; }
       virtual bool full() const { return false; }
 
+      // Only one waiter is woken up for each elem. A waiter which is not
+      // going to use it passes the wake up to the next one
+      void passWakeUp(eEventType event_type) {
+        if (event_type == EVT_CHANNEL_CAN_PULL) {
+          if (!empty() || closed())
+            detachOneWaitingForPull();
+        }
+        else if (!full() || closed()) {
+          detachOneWaitingForPush();
+        }
+      }
+
       static TBaseChan* findChannelByHandle(TChanHandle h);
     };
 
+    // Keeps the channel alive while the coroutine is using it, even if it
+    // gets destroyed while the coroutine sleeps inside
+    struct TChanUse {
+      TBaseChan* c;
+      TChanUse(TBaseChan* new_c) : c(new_c) { if (c) c->enter(); }
+      ~TChanUse() { if (c) c->leave(); }
+    };
+
+    // -------------------------------------------------------
+    // What the operators of TTypedChannel<T> need from the channels of T
+    template< typename T >
+    class TTypedBaseChan : public TBaseChan {
+    public:
+      virtual bool   pullObj(T& obj) = 0;
+      virtual bool   pushObj(T& obj) = 0;
+      virtual size_t pushObjs(const T* objs, size_t count) = 0;
+      virtual size_t pullObjs(T* objs, size_t max_count) = 0;
+      virtual T*     reserve() = 0;
+      virtual bool   commit() = 0;
+      virtual void   unreserve() = 0;
+      virtual T*     peek() = 0;
+      virtual void   release() = 0;
+    };
 
     // -------------------------------------------------------
+    // Storage of the ring of TMemChan. The capacity is set at runtime
     template< typename T >
-    class TMemChan : public TBaseChan {
+    class TDynamicSlots {
+      std::unique_ptr< T[] > data;
+      size_t                 max_elems;
+    public:
+      TDynamicSlots(size_t new_max_elems) : data(new T[new_max_elems]), max_elems(new_max_elems) { }
+      size_t capacity() const { return max_elems; }
+      size_t index(size_t counter) const { return counter % max_elems; }
+      T* slots() { return data.get(); }
+    };
+
+    // Inline storage of the ring of TStaticChan, indexed with a mask
+    template< typename T, size_t N >
+    class TStaticSlots {
+      static_assert(N > 0 && (N & (N - 1)) == 0, "The capacity of a static channel must be a power of two");
+      T data[N];
+    public:
+      TStaticSlots(size_t) { }
+      size_t capacity() const { return N; }
+      size_t index(size_t counter) const { return counter & (N - 1); }
+      T* slots() { return data; }
+    };
+
+    // -------------------------------------------------------
+    // Ring of elems. head & tail are counters of the elems pulled & pushed,
+    // which the storage converts to slot indices.
+    // A ring with capacity 0 is unbuffered. Senders and receivers park with
+    // the address of their value in the TWatchedEvent, and the one arriving
+    // later moves the value directly to/from the parked one.
+    template< typename T, typename TSlots >
+    class TRingChan final : public TTypedBaseChan< T > {
+
+      typedef TTypedBaseChan< T > TParent;
+      using TParent::handle;
+      using TParent::waiting_for_push;
+      using TParent::waiting_for_pull;
+      using TParent::closed;
+      using TParent::detachOneWaitingForPull;
+      using TParent::detachOneWaitingForPush;
+
+      TSlots            data;
+      size_t            head = 0;
+      size_t            tail = 0;
+
+      // A slot given by reserve or peek blocks the others until it's
+      // given back, so the elements keep the fifo order
+      bool              is_reserved = false;
+      bool              is_peeked = false;
+
+      size_t size() const { return tail - head; }
+      T& at(size_t counter) { return data.slots()[data.index(counter)]; }
+
+      bool full() const override {
+        if (unbuffered())
+          return !firstParkedWithValue(waiting_for_pull);
+        return is_reserved || size() == data.capacity();
+      }
+      bool empty() const override {
+        if (unbuffered())
+          return !firstParkedWithValue(waiting_for_push);
+        return is_peeked || size() == 0;
+      }
 
-      size_t            max_elems = 0;
-      size_t            nelems_stored = 0;
-      size_t            first_idx = 0;
-      std::vector< T >  data;
+      // -------------------------------------------------------------
+      // The waiting lists also have the ones which just want to be
+      // notified, like the users of choose
+      static TWatchedEvent* firstParkedWithValue(const TList& waiters) {
+        for (auto item = waiters.first; item; item = item->next) {
+          auto we = static_cast<TWatchedEvent*>(item);
+          if (we->channel.obj)
+            return we;
+        }
+        return nullptr;
+      }
+
+      // Moves the value from/to the parked one, and wakes it up. A null
+      // obj tells the parked one the exchange has been done
+      void handOff(TList& waiters, TWatchedEvent* we, T& obj, bool to_parked) {
+        waiters.detach(we);
+        T* parked_obj = (T*)we->channel.obj;
+        if (to_parked)
+          *parked_obj = std::move(obj);
+        else
+          obj = std::move(*parked_obj);
+        we->channel.obj = nullptr;
+        wakeUp(we);
+      }
+
+      // Parks until someone takes/fills obj. Coroutines in a shared stack
+      // park with a copy in the heap, because their stack is not always
+      // in place while sleeping. Returns false if the channel gets closed
+      bool parkWithValue(T& obj, eEventType event_type) {
+        std::unique_ptr< T > tmp;
+        T* parked_obj = &obj;
+        if (runsInSharedStack()) {
+          tmp.reset(event_type == EVT_CHANNEL_CAN_PUSH ? new T(std::move(obj)) : new T());
+          parked_obj = tmp.get();
+        }
+        TWatchedEvent we(handle, event_type);
+        we.channel.obj = parked_obj;
+
+        // Let the ones waiting without a value know someone has arrived
+        if (event_type == EVT_CHANNEL_CAN_PUSH)
+          detachOneWaitingForPull();
+        else
+          detachOneWaitingForPush();
+
+        wait(&we, 1);
+        bool exchanged = (we.channel.obj == nullptr);
+        // The sender gets its value back if it was not taken
+        if (tmp && (exchanged == (event_type == EVT_CHANNEL_CAN_PULL)))
+          obj = std::move(*tmp);
+        return exchanged;
+      }
+
+      bool pushDirect(T& obj) {
+        while (!closed()) {
+          if (auto we = firstParkedWithValue(waiting_for_pull)) {
+            handOff(waiting_for_pull, we, obj, true);
+            return true;
+          }
+          if (parkWithValue(obj, EVT_CHANNEL_CAN_PUSH))
+            return true;
+        }
+        return false;
+      }
 
-      bool full() const { return nelems_stored == max_elems; }
-      bool empty() const { return nelems_stored == 0; }
+      bool pullDirect(T& obj) {
+        while (true) {
+          if (auto we = firstParkedWithValue(waiting_for_push)) {
+            handOff(waiting_for_push, we, obj, false);
+            return true;
+          }
+          if (closed())
+            return false;
+          if (parkWithValue(obj, EVT_CHANNEL_CAN_PULL))
+            return true;
+        }
+      }
 
       // -------------------------------------------------------------
       void pushObjData(T& new_data) {
-        assert(nelems_stored < max_elems);
+        assert(size() < data.capacity());
         assert(!closed());
 
-        data[ (first_idx + nelems_stored) % max_elems ] = std::move( new_data );
-        ++nelems_stored;
+        at(tail) = std::move( new_data );
+        ++tail;
         
-        detachOneWaitingForPull();
+        if (!waiting_for_pull.empty())
+          detachOneWaitingForPull();
       }
 
       // -------------------------------------------------------------
       void pullObjData(T& new_data) {
-        assert(data.data());
-        assert(nelems_stored > 0);
+        assert(size() > 0);
           
-        new_data = std::move(data[first_idx]);
-        
-        --nelems_stored;
-        first_idx = (first_idx + 1) % max_elems;
+        new_data = std::move(at(head));
+        ++head;
 
-        detachOneWaitingForPush();
+        if (!waiting_for_push.empty())
+          detachOneWaitingForPush();
       }
 
-    public:
+      // -------------------------------------------------------------
+      // Copies as many as fit in at most two contiguous runs of the ring,
+      // and wakes up one waiter for each elem pushed
+      size_t pushObjsData(const T* objs, size_t count) {
+        assert(!full());
+        size_t n = std::min(count, data.capacity() - size());
+        size_t idx = data.index(tail);
+        size_t n1 = std::min(n, data.capacity() - idx);
+        std::copy(objs, objs + n1, data.slots() + idx);
+        std::copy(objs + n1, objs + n, data.slots());
+        tail += n;
+        for (size_t i = 0; i < n && detachOneWaitingForPull(); ++i);
+        return n;
+      }
 
-      TMemChan(size_t new_max_elems) {
-        max_elems = new_max_elems;
-        data.resize(max_elems);
+      size_t pullObjsData(T* objs, size_t max_count) {
+        assert(!empty());
+        size_t n = std::min(max_count, size());
+        size_t idx = data.index(head);
+        size_t n1 = std::min(n, data.capacity() - idx);
+        std::move(data.slots() + idx, data.slots() + idx + n1, objs);
+        std::move(data.slots(), data.slots() + (n - n1), objs + n1);
+        head += n;
+        for (size_t i = 0; i < n && detachOneWaitingForPush(); ++i);
+        return n;
       }
 
-      ~TMemChan() {
-        close();
+    public:
+
+      TRingChan(size_t new_max_elems) : data(new_max_elems) { }
+
+      bool unbuffered() const { return data.capacity() == 0; }
+
+      ~TRingChan() {
+        this->close();
       }
 
-      bool pullObj(T& obj) {
+      bool pullObj(T& obj) override {
 
-        assert(this);
+        if (unbuffered())
+          return pullDirect(obj);
 
         while (empty() && !closed()) 
           wait(canRead(handle));
@@ -107,7 +335,10 @@ namespace Coroutines {
         return true;
       }
 
-      bool pushObj( T& obj) {
+      bool pushObj( T& obj) override {
+
+        if (unbuffered())
+          return pushDirect(obj);
 
         while (full() && !closed())
           wait(canWrite(handle));
@@ -120,17 +351,123 @@ namespace Coroutines {
         return true;
       }
 
+      // Waits until all the objs are pushed. Returns less than count if
+      // the channel gets closed
+      size_t pushObjs(const T* objs, size_t count) override {
+        size_t npushed = 0;
+        if (unbuffered()) {
+          T obj;
+          while (npushed < count && pushDirect(obj = objs[npushed]))
+            ++npushed;
+          return npushed;
+        }
+        while (npushed < count) {
+          while (full() && !closed())
+            wait(canWrite(handle));
+          if (closed())
+            break;
+          npushed += pushObjsData(objs + npushed, count - npushed);
+        }
+        return npushed;
+      }
+
+      // Waits until there is something to pull. Returns 0 when the
+      // channel is closed and empty
+      size_t pullObjs(T* objs, size_t max_count) override {
+        if (!max_count)
+          return 0;
+        if (unbuffered()) {
+          // Take the first one, and then those already waiting
+          if (!pullDirect(objs[0]))
+            return 0;
+          size_t n = 1;
+          while (n < max_count && !empty())
+            pullDirect(objs[n++]);
+          return n;
+        }
+        while (empty() && !closed())
+          wait(canRead(handle));
+        if (empty())
+          return 0;
+        return pullObjsData(objs, max_count);
+      }
+
+      // -------------------------------------------------------------
+      // Zero copy access. The slots keep their objects between laps, so
+      // the producer can fill the object in place, reusing its memory
+      T* reserve() override {
+        assert(!unbuffered());
+        while (full() && !closed())
+          wait(canWrite(handle));
+        if (closed())
+          return nullptr;
+        is_reserved = true;
+        return &at(tail);
+      }
+
+      bool commit() override {
+        assert(is_reserved);
+        is_reserved = false;
+        if (closed())
+          return false;
+        ++tail;
+        detachOneWaitingForPull();
+        if (!full())
+          detachOneWaitingForPush();
+        return true;
+      }
+
+      void unreserve() override {
+        assert(is_reserved);
+        is_reserved = false;
+        detachOneWaitingForPush();
+      }
+
+      T* peek() override {
+        assert(!unbuffered());
+        while (empty() && !closed())
+          wait(canRead(handle));
+        if (empty())
+          return nullptr;
+        is_peeked = true;
+        return &at(head);
+      }
+
+      void release() override {
+        assert(is_peeked);
+        assert(size() > 0);
+        is_peeked = false;
+        ++head;
+        detachOneWaitingForPush();
+        if (!empty())
+          detachOneWaitingForPull();
+      }
+
     };
 
+    template< typename T >
+    using TMemChan = TRingChan< T, TDynamicSlots< T > >;
+
+    template< typename T, size_t N >
+    using TStaticChan = TRingChan< T, TStaticSlots< T, N > >;
+
     // --------------------------------------------------------------
     TChanHandle registerChannel(TBaseChan* c, TChanHandle::eClassID channel_type);
 
     template< typename T >
     TChanHandle createTypedChannel(size_t max_capacity) {
+      TSchedLock lock;
       auto c = new TMemChan<T>(max_capacity);
       return registerChannel(c, TChanHandle::eClassID::CT_MEMORY);
     }
 
+    template< typename T, size_t N >
+    TChanHandle createStaticChannel() {
+      TSchedLock lock;
+      auto c = new TStaticChan<T, N>(N);
+      return registerChannel(c, TChanHandle::eClassID::CT_MEMORY);
+    }
+
   }
 
   // -------------------------------------------------------------
@@ -138,37 +475,160 @@ namespace Coroutines {
   template< typename T >
   struct TTypedChannel : public TChanHandle {
     TTypedChannel<T>(TChanHandle h) : TChanHandle(h) {};
+    // With max_capacity 0 the channel is unbuffered, like in go: each
+    // push waits for a pull, and the value goes directly from one to the other
     static TTypedChannel<T> create(size_t max_capacity = 1) {
       return internal::createTypedChannel<T>(max_capacity);
     }
+
+    // The ring is stored inside the channel, and N must be a power of two,
+    // so the slot of each elem is found with a mask
+    template< size_t N >
+    static TTypedChannel<T> createStatic() {
+      return internal::createStaticChannel<T, N>();
+    }
+
+    // Batched versions of operator<<, with a single lookup & lock for all
+    // the objs. push waits until all the objs are pushed, pull waits until
+    // at least one obj is available. Both return the number of objs moved,
+    // which is less than requested only if the channel gets closed/empty
+    size_t push(const T* objs, size_t count) const;
+    size_t pull(T* objs, size_t max_count) const;
+
+    // Zero copy api. reserve waits for a free slot and returns the object
+    // stored there to be filled in place. commit publishes it, or unreserve
+    // gives it back. peek waits for the next object, which stays in the
+    // channel until release. Only one slot can be reserved and one peeked
+    // at a time per channel. Return nullptr/false if the channel is closed
+    T* reserve() const;
+    bool commit() const;
+    void unreserve() const;
+    T* peek() const;
+    void release() const;
+
+  private:
+    internal::TTypedBaseChan<T>* memChan() const {
+      auto c = internal::TBaseChan::findChannelByHandle(*this);
+      assert(!c || class_id == CT_MEMORY);
+      return (internal::TTypedBaseChan<T>*)c;
+    }
   };
 
+  template< typename T >
+  size_t TTypedChannel<T>::push(const T* objs, size_t count) const {
+    internal::TSchedLock lock;
+    auto c = memChan();
+    internal::TChanUse use(c);
+    size_t n = c ? c->pushObjs(objs, count) : 0;
+    if (n)
+      internal::traceChannel(internal::TRACE_CHANNEL_PUSH, *this);
+    return n;
+  }
+
+  template< typename T >
+  size_t TTypedChannel<T>::pull(T* objs, size_t max_count) const {
+    internal::TSchedLock lock;
+    auto c = memChan();
+    internal::TChanUse use(c);
+    size_t n = c ? c->pullObjs(objs, max_count) : 0;
+    if (n)
+      internal::traceChannel(internal::TRACE_CHANNEL_PULL, *this);
+    return n;
+  }
+
+  template< typename T >
+  T* TTypedChannel<T>::reserve() const {
+    internal::TSchedLock lock;
+    auto c = memChan();
+    internal::TChanUse use(c);
+    T* obj = c ? c->reserve() : nullptr;
+    // The reserved slot keeps the channel alive until commit/unreserve
+    if (obj)
+      c->enter();
+    return obj;
+  }
+
+  template< typename T >
+  bool TTypedChannel<T>::commit() const {
+    internal::TSchedLock lock;
+    auto c = memChan();
+    if (!c)
+      return false;
+    bool committed = c->commit();
+    c->leave();
+    return committed;
+  }
+
+  template< typename T >
+  void TTypedChannel<T>::unreserve() const {
+    internal::TSchedLock lock;
+    if (auto c = memChan()) {
+      c->unreserve();
+      c->leave();
+    }
+  }
+
+  template< typename T >
+  T* TTypedChannel<T>::peek() const {
+    internal::TSchedLock lock;
+    auto c = memChan();
+    internal::TChanUse use(c);
+    T* obj = c ? c->peek() : nullptr;
+    if (obj)
+      c->enter();
+    return obj;
+  }
+
+  template< typename T >
+  void TTypedChannel<T>::release() const {
+    internal::TSchedLock lock;
+    if (auto c = memChan()) {
+      c->release();
+      c->leave();
+    }
+  }
+
   // -------------------------------------------------------------
   
-  // Closes channel
+  // Closes channel. The elems inside can still be pulled, and the handle
+  // stays valid until the channel is destroyed
   bool close(TChanHandle cid);
 
+  // Closes the channel, dropping the elems still inside, and releases it
+  // as soon as the coroutines sleeping in it leave
+  bool destroy(TChanHandle cid);
+
   // Check if the given channel handle is valid.
   bool isChannel(TChanHandle cid);
 
   // -------------------------------------------------------------
   template< typename T >
   bool operator<<(T& obj, TTypedChannel<T> cid) {
+    internal::TSchedLock lock;
     auto c = internal::TBaseChan::findChannelByHandle(cid);
     if (!c || (c->closed() && c->empty()))
       return false;
-    auto tc = (internal::TMemChan<T> *)c;
-    return tc->pullObj(obj);
+    internal::TChanUse use(c);
+    auto tc = (internal::TTypedBaseChan<T> *)c;
+    if (!tc->pullObj(obj))
+      return false;
+    internal::traceChannel(internal::TRACE_CHANNEL_PULL, cid);
+    return true;
   }
 
   template< typename T >
   bool operator<<(TTypedChannel<T> cid, T obj) {
+    internal::TSchedLock lock;
     auto c = internal::TBaseChan::findChannelByHandle(cid);
     if (!c || c->closed())
       return false;
 
-    auto tc = (internal::TMemChan<T> *)c;
-    return tc->pushObj(obj);
+    internal::TChanUse use(c);
+    auto tc = (internal::TTypedBaseChan<T> *)c;
+    if (!tc->pushObj(obj))
+      return false;
+    internal::traceChannel(internal::TRACE_CHANNEL_PUSH, cid);
+    return true;
   }
 
   // -------------------------------------------------------------
@@ -177,7 +637,10 @@ namespace Coroutines {
     TTimeDelta timeForNextEvent() const;
   };
   bool operator<<(TTimeStamp& value, TTimeHandle cid);
+  // Periodic timer. Released with destroy()
   TTimeHandle every(TTimeDelta interval_time);
+  // One shot timer. Released once it has fired and been pulled, or with
+  // destroy() if it's not going to be pulled
   TTimeHandle after(TTimeDelta interval_time);
 
   // Read discarting the data. 
@@ -9,21 +9,21 @@ namespace Coroutines {
   // -------------------------------------------------------
   // -------------------------------------------------------
   struct TChanHandle {
-    enum eClassID { CT_INVALID = 0, CT_TIMER = 1, CT_MEMORY, CT_IO };
+    enum eClassID { CT_INVALID = 0, CT_TIMER = 1, CT_MEMORY, CT_IO, CT_MPMC };
     
     eClassID     class_id : 4;
-    uint32_t     index : 12;
-    uint32_t     age : 16;
+    uint32_t     age : 28;
+    uint32_t     index;
 
     TChanHandle() {
       class_id = CT_INVALID;
       index = age = 0;
     }
 
-    TChanHandle(eClassID channel_type, int32_t new_index) {
+    TChanHandle(eClassID channel_type, int32_t new_index, uint32_t new_age = 1) {
       class_id = channel_type;
       index = new_index;
-      age = 1;
+      age = new_age;
     }
     
     bool operator==(const TChanHandle h) const {
@@ -32,7 +32,7 @@ namespace Coroutines {
 
   };
 
-  static_assert(sizeof(TChanHandle) == sizeof(uint32_t), "TChanHandle should have size of int32_t");
+  static_assert(sizeof(TChanHandle) == sizeof(uint64_t), "TChanHandle should have size of int64_t");
 
 }
 
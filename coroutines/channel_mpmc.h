@@ -0,0 +1,265 @@
+#ifndef INC_COROUTINES_CHANNEL_MPMC_H_
+#define INC_COROUTINES_CHANNEL_MPMC_H_
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include "channel.h"
+
+namespace Coroutines {
+
+  // -------------------------------------------------------------
+  namespace internal {
+
+    // True if this thread can take the sched lock to wake up coroutines: the
+    // thread running the single thread loop, or any thread in M:N mode.
+    bool canWakeUpFromThisThread();
+
+    // Other threads queue the wake up, and the loop delivers it in the next
+    // pollEvents. Can be called from any thread
+    void postChannelWakeUp(TChanHandle h, eEventType event_type, bool wake_all);
+
+    // Must be called with the sched lock taken
+    void deliverPostedWakeUps();
+
+    // Unregisters & deletes the channel. Can be called from any thread
+    void retireChannel(TBaseChan* c);
+
+    // -------------------------------------------------------------
+    // Bounded multi producer/multi consumer ring. Each cell has a sequence
+    // number telling if it is ready to be written (seq == pos) or read
+    // (seq == pos + 1) in the lap of pos, so producers and consumers only
+    // have to agree on a position with a CAS. The sched lock is only taken
+    // to park when the ring is full/empty, or to wake up the parked ones.
+    template< typename T >
+    class TMPMCChan : public TBaseChan {
+
+      struct TCell {
+        std::atomic<size_t> seq;
+        T                   data;
+      };
+
+      static const size_t cache_line_size = 64;
+
+      std::unique_ptr< TCell[] > cells;
+      size_t                     mask = 0;
+
+      // Producers and consumers don't share cache lines
+      char                  pad0[cache_line_size];
+      std::atomic<size_t>   push_pos{ 0 };
+      char                  pad1[cache_line_size - sizeof(std::atomic<size_t>)];
+      std::atomic<size_t>   pull_pos{ 0 };
+      char                  pad2[cache_line_size - sizeof(std::atomic<size_t>)];
+
+      // Coroutines about to wait or waiting in the lists of the channel
+      std::atomic<int>      num_waiting_push{ 0 };
+      std::atomic<int>      num_waiting_pull{ 0 };
+
+      // The pairs (store pos, load num_waiting) in the producer and
+      // (store num_waiting, load pos) in the waiter are separated by full
+      // fences, so at least one of the two sides sees the other.
+      void wakeOne(std::atomic<int>& num_waiting, eEventType event_type) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (num_waiting.load(std::memory_order_relaxed) == 0)
+          return;
+        if (!canWakeUpFromThisThread()) {
+          postChannelWakeUp(handle, event_type, false);
+          return;
+        }
+        TSchedLock lock;
+        if (event_type == EVT_CHANNEL_CAN_PULL)
+          detachOneWaitingForPull();
+        else
+          detachOneWaitingForPush();
+      }
+
+      void waitFor(std::atomic<int>& num_waiting, TWatchedEvent we) {
+        // Threads which are not running a coroutine can't park
+        if (current() == THandle()) {
+          std::this_thread::yield();
+          return;
+        }
+        num_waiting.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // Returns without sleeping if the ring has changed in the meantime
+        wait(we);
+        num_waiting.fetch_sub(1, std::memory_order_relaxed);
+      }
+
+    public:
+
+      TMPMCChan(size_t new_max_elems) {
+        size_t n = 2;
+        while (n < new_max_elems)
+          n *= 2;
+        mask = n - 1;
+        cells.reset(new TCell[n]);
+        for (size_t i = 0; i < n; ++i)
+          cells[i].seq.store(i, std::memory_order_relaxed);
+      }
+
+      ~TMPMCChan() {
+        close();
+      }
+
+      // The handles own the channel, and other threads might still be
+      // using it when it gets closed
+      bool canBeReleased() const override { return false; }
+
+      bool empty() const override {
+        size_t pos = pull_pos.load(std::memory_order_acquire);
+        size_t seq = cells[pos & mask].seq.load(std::memory_order_acquire);
+        return (intptr_t)(seq - (pos + 1)) < 0;
+      }
+
+      bool full() const override {
+        size_t pos = push_pos.load(std::memory_order_acquire);
+        size_t seq = cells[pos & mask].seq.load(std::memory_order_acquire);
+        return (intptr_t)(seq - pos) < 0;
+      }
+
+      // -------------------------------------------------------------
+      // Never blocks. Returns false if the ring is full
+      bool tryPush(T& obj) {
+        size_t pos = push_pos.load(std::memory_order_relaxed);
+        TCell* cell = nullptr;
+        while (true) {
+          cell = &cells[pos & mask];
+          size_t seq = cell->seq.load(std::memory_order_acquire);
+          intptr_t diff = (intptr_t)(seq - pos);
+          if (diff == 0) {
+            if (push_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+              break;
+          }
+          else if (diff < 0) {
+            return false;
+          }
+          else {
+            pos = push_pos.load(std::memory_order_relaxed);
+          }
+        }
+        cell->data = std::move(obj);
+        cell->seq.store(pos + 1, std::memory_order_release);
+        wakeOne(num_waiting_pull, EVT_CHANNEL_CAN_PULL);
+        return true;
+      }
+
+      // Never blocks. Returns false if the ring is empty
+      bool tryPull(T& obj) {
+        size_t pos = pull_pos.load(std::memory_order_relaxed);
+        TCell* cell = nullptr;
+        while (true) {
+          cell = &cells[pos & mask];
+          size_t seq = cell->seq.load(std::memory_order_acquire);
+          intptr_t diff = (intptr_t)(seq - (pos + 1));
+          if (diff == 0) {
+            if (pull_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+              break;
+          }
+          else if (diff < 0) {
+            return false;
+          }
+          else {
+            pos = pull_pos.load(std::memory_order_relaxed);
+          }
+        }
+        obj = std::move(cell->data);
+        cell->seq.store(pos + mask + 1, std::memory_order_release);
+        wakeOne(num_waiting_push, EVT_CHANNEL_CAN_PUSH);
+        return true;
+      }
+
+      // -------------------------------------------------------------
+      // Blocking versions. Coroutines park in the channel, other threads spin
+      bool pushObj(T& obj) {
+        while (!closed()) {
+          if (tryPush(obj))
+            return true;
+          waitFor(num_waiting_push, canWrite(handle));
+        }
+        return false;
+      }
+
+      bool pullObj(T& obj) {
+        while (true) {
+          if (tryPull(obj))
+            return true;
+          if (closed()) {
+            // Someone might have pushed just before the close
+            return tryPull(obj);
+          }
+          waitFor(num_waiting_pull, canRead(handle));
+        }
+      }
+
+      // Can be called from any thread
+      void closeFromAnyThread() {
+        if (canWakeUpFromThisThread()) {
+          TSchedLock lock;
+          close();
+          return;
+        }
+        is_closed = true;
+        postChannelWakeUp(handle, EVT_CHANNEL_CAN_PUSH, true);
+        postChannelWakeUp(handle, EVT_CHANNEL_CAN_PULL, true);
+      }
+    };
+
+    // Can be called from plain threads while the loop runs. The registry
+    // has its own mutex
+    template< typename T >
+    std::shared_ptr< TMPMCChan<T> > createMPMCChannel(size_t max_capacity) {
+      auto c = new TMPMCChan<T>(max_capacity);
+      registerChannel(c, TChanHandle::eClassID::CT_MPMC);
+      return std::shared_ptr< TMPMCChan<T> >(c, [](TMPMCChan<T>* c) { retireChannel(c); });
+    }
+
+  }
+
+  // -------------------------------------------------------------
+  // Channel which can be shared by coroutines running in any thread, and
+  // by plain threads. The handle keeps the address of the channel, so
+  // push & pull don't have to search it with the sched lock taken.
+  // The handles share the ownership of the channel, which is released
+  // with the last one. The capacity is rounded up to a power of two.
+  template< typename T >
+  struct TMPMCChannel : public TChanHandle {
+    std::shared_ptr< internal::TMPMCChan<T> > chan;
+
+    TMPMCChannel() = default;
+    TMPMCChannel(std::shared_ptr< internal::TMPMCChan<T> > c) : TChanHandle(c->handle), chan(std::move(c)) {}
+
+    static TMPMCChannel<T> create(size_t max_capacity = 64) {
+      return TMPMCChannel<T>(internal::createMPMCChannel<T>(max_capacity));
+    }
+
+    bool tryPush(T obj) const { return !chan->closed() && chan->tryPush(obj); }
+    bool tryPull(T& obj) const { return chan->tryPull(obj); }
+
+    // Wakes up everyone waiting in the channel. Can be called from any thread
+    void close() const { chan->closeFromAnyThread(); }
+  };
+
+  // -------------------------------------------------------------
+  // The handle is taken by reference to not touch the shared counter
+  template< typename T >
+  bool operator<<(T& obj, const TMPMCChannel<T>& ch) {
+    assert(ch.chan);
+    if (!ch.chan->pullObj(obj))
+      return false;
+    internal::traceChannel(internal::TRACE_CHANNEL_PULL, ch);
+    return true;
+  }
+
+  template< typename T >
+  bool operator<<(const TMPMCChannel<T>& ch, T obj) {
+    assert(ch.chan);
+    if (!ch.chan->pushObj(obj))
+      return false;
+    internal::traceChannel(internal::TRACE_CHANNEL_PUSH, ch);
+    return true;
+  }
+
+}
+
+#endif
@@ -1,30 +1,163 @@
 #include "coroutines.h"
 #include "io_events.h"
+#include "io_ring.h"
+#include "stacks.h"
+#include "segmented_table.h"
 #include "fcontext/fcontext.h"
 #include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstdio>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 #pragma comment(lib, "fcontext.lib")
 
+// A coroutine can be resumed in a different OS thread after a jump_fcontext, so
+// the compiler must not cache the address of a thread_local across a switch.
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CO_NOINLINE             __declspec(noinline)
+#define CO_COMPILER_BARRIER()   _ReadWriteBarrier()
+#else
+#define CO_NOINLINE             __attribute__((noinline))
+#define CO_COMPILER_BARRIER()   asm volatile("" ::: "memory")
+#endif
+
 namespace Coroutines {
 
-  static const uint16_t INVALID_ID = 0xffff;
+  static const uint32_t INVALID_ID = 0xffffffff;
 
   // --------------------------
   namespace internal {
 
     // -----------------------------------------
-    THandle h_current;
+    struct TThreadState {
+      THandle h_current;
+      int     lock_depth = 0;       // Nesting of TSchedLock's in this thread
+      int     worker_idx = -1;      // Index in the workers, -1 if not a worker
+      bool    runs_loop = false;    // Has called executeActives
+      fcontext_t loop_ctx = nullptr;  // Where coroutines go when there is nothing else to run
+    };
+
+    CO_NOINLINE TThreadState& threadState() {
+      static thread_local TThreadState ts;
+      CO_COMPILER_BARRIER();
+      return ts;
+    }
+
     struct  TCoro;
 
     // --------------------------------------------
-    TIOEvents              io_events;
-    std::vector< TCoro* >  coros;
+    TSegmentedTable< TCoro > coros;     // Never move, so we can keep pointers to them
     std::vector< THandle > coros_free;
+    TList                  ready;           // TCoro's ready to run in single thread mode
+    TList                  ready_this_loop; // The ones the current loop is running
+    bool                   direct_switching = true;
+    int                    direct_switches_left = 0;    // Before the loop has to poll again
+    static const int       max_direct_switches_per_loop = 64;
     int runActives();
 		size_t                 num_loops = 0;
+    int                    num_alive = 0;       // Coroutines not FREE
+
+    // --------------------------------------------
+    // While running in several threads, the OS thread doing a coroutine switch
+    // always holds the sched_mutex, so the mutex never changes owner during
+    // the jump_fcontext and each side restores its own lock_depth.
+    // The sched_mutex guards all the scheduler state, the run queues of the
+    // workers included. Threads not running coroutines read multithreaded
+    std::atomic<bool>      multithreaded{ false };
+    std::mutex             sched_mutex;
+
+    void lockScheduler() {
+      auto& ts = threadState();
+      if (ts.lock_depth++ == 0 && multithreaded)
+        sched_mutex.lock();
+    }
+
+    void unlockScheduler() {
+      auto& ts = threadState();
+      assert(ts.lock_depth > 0);
+      if (--ts.lock_depth == 0 && multithreaded)
+        sched_mutex.unlock();
+    }
+
+    TSchedLock::TSchedLock() {
+      lockScheduler();
+    }
+
+    TSchedLock::~TSchedLock() {
+      unlockScheduler();
+    }
+
+    // Only the outermost lock can be released, the one of the loop
+    TSchedUnlock::TSchedUnlock() {
+      auto& ts = threadState();
+      saved_depth = ts.lock_depth;
+      assert(saved_depth <= 1);
+      ts.lock_depth = 0;
+      if (saved_depth && multithreaded)
+        sched_mutex.unlock();
+    }
+
+    TSchedUnlock::~TSchedUnlock() {
+      if (saved_depth && multithreaded)
+        sched_mutex.lock();
+      threadState().lock_depth = saved_depth;
+    }
+
+    // Set while a thread sleeps in the io backend, so whoever adds work
+    // or an earlier timeout can wake it up
+    bool                   poller_blocked = false;
+    bool                   poller_interrupted = false;
+    TTimeStamp             poller_wakes_at;
+
+    void kickPoller() {
+      if (poller_blocked && !poller_interrupted) {
+        poller_interrupted = true;
+        io_events.interrupt();
+      }
+    }
+
+    void enqueueRunnable(TCoro* co);
+    void runOnce(TCoro* co);
+    TCoro* byHandle(THandle h);
+    TCoro* nextToRunDirectly(TCoro* from);
+    void landed(fcontext_transfer_t t);
+    int unregisterFromEvents(TCoro* co);
+
+    // Other threads don't know if the loop is using the scheduler state
+    bool canWakeUpFromThisThread() {
+      return multithreaded || threadState().runs_loop;
+    }
+
+    // -----------------------------------------
+    // Coroutines started with STACK_SHARED run in one of these stacks. Only
+    // the occupant has its frames in place, the others keep a copy of the
+    // used part of the stack, which is restored when they are resumed.
+    // In M:N mode the worker idx % num_workers owns the shared stack idx.
+    struct TSharedStack {
+      fcontext_stack_t stack = { nullptr, 0 };
+      TCoro*           occupant = nullptr;
+    };
+    std::vector< TSharedStack > shared_stacks;
+
+    int sharedStackOfThisThread() {
+      int idx = threadState().worker_idx;
+      if (idx < 0)
+        idx = 0;
+      if ((size_t)idx >= shared_stacks.size())
+        shared_stacks.resize(idx + 1);
+      auto& ss = shared_stacks[idx];
+      if (!ss.stack.sptr)
+        ss.stack = stack_pools.acquire(STACK_SHARED);
+      return idx;
+    }
 
     // -----------------------------------------
-    struct TCoro {
+    struct TCoro : public TListItem {
 
       enum eState {
         UNINITIALIZED
@@ -36,6 +169,11 @@ namespace Coroutines {
       eState                    state = UNINITIALIZED;
       THandle                   this_handle;
 
+      // Scheduling. Only modified with the sched lock taken
+      bool                      parked = true;            // Not being executed by any thread
+      bool                      queued = false;           // Already in the ready list or in the run queue of a worker
+      bool                      exit_requested = false;   // exitCo was called while running in other thread
+
       // Wait
       TList                     waiting_for_me;
       TWatchedEvent*            event_waking_me_up = nullptr;      // Which event took us from the WAITING_FOR_EVENT
@@ -44,19 +182,37 @@ namespace Coroutines {
       TWatchedEvent*            watched_events = nullptr;
       int                       nwatched_events = 0;
 
+      // Shared stack mode
+      int                       shared_idx = -1;          // Index in shared_stacks, -1 if we own the stack
+      std::vector< char >       saved_stack;              // Our frames while others use the shared stack
+      std::vector< TWatchedEvent > saved_events;          // What others see of our watched events
+
       // User entry point 
-      TBootFn                   boot_fn;
+      TBootCallable             boot_fn;
+
+#ifdef COROUTINES_PROFILING
+      TCoroStats                stats;
+      TTimeStamp                running_since;
+      TTimeStamp                waiting_since;
+#endif
 
       // Low Level 
       fcontext_transfer_t       ip = { nullptr, nullptr };
       fcontext_stack_t          stack = { nullptr, 0 };
-      fcontext_transfer_t       caller_ctx = { nullptr, nullptr };
+      eStackSize                stack_size = STACK_DEFAULT;
 
       static void ctxEntryFn(fcontext_transfer_t t) {
-        TCoro* co = reinterpret_cast<TCoro*>(t.data);
+        // We inherit the sched lock from the thread which jumped here, but the
+        // user code runs without it
+        threadState().lock_depth = 1;
+        landed(t);
+        TCoro* co = byHandle(threadState().h_current);
         assert(co);
-        co->caller_ctx = t;
+        unlockScheduler();
         co->runUserFn();
+        // The captures go away as soon as the coroutine ends
+        co->boot_fn.reset();
+        lockScheduler();
         co->epilogue();
       }
 
@@ -65,43 +221,126 @@ namespace Coroutines {
         boot_fn();
       }
 
-      static const size_t default_stack_size = 64 * 1024;
-      void createStack() {
-        stack = ::create_fcontext_stack(default_stack_size);
-      }
-
-      void destroyStack() {
-        destroy_fcontext_stack(&stack);
+      // Free coroutines keep their stack, unless a different size is required
+      void setStack(eStackSize new_stack_size) {
+        if (stack.sptr && new_stack_size == stack_size && new_stack_size != STACK_SHARED)
+          return;
+        if (stack_size != STACK_SHARED)
+          stack_pools.release(stack, stack_size);
+        if (new_stack_size == STACK_SHARED) {
+          shared_idx = sharedStackOfThisThread();
+          stack = shared_stacks[shared_idx].stack;
+        }
+        else {
+          shared_idx = -1;
+          stack = stack_pools.acquire(new_stack_size);
+        }
+        stack_size = new_stack_size;
       }
 
       // This has not yet started, it's only ready to run in the stack provided
       void resetIP() {
-        ip.ctx = make_fcontext( stack.sptr, stack.ssize, &ctxEntryFn );
-        ip.data = this;
+        // The shared stack might be in use, the context is made when we get in
+        if (shared_idx >= 0)
+          ip.ctx = nullptr;
+        else
+          ip.ctx = make_fcontext( stack.sptr, stack.ssize, &ctxEntryFn );
+      }
+
+      // Must be called with the sched lock taken, before jumping into the shared stack
+      void enterSharedStack() {
+        auto& ss = shared_stacks[shared_idx];
+        if (ss.occupant == this)
+          return;
+        if (ss.occupant)
+          ss.occupant->leaveSharedStack();
+        ss.occupant = this;
+        if (!ip.ctx) {
+          ip.ctx = make_fcontext(stack.sptr, stack.ssize, &ctxEntryFn);
+          return;
+        }
+        // Put back our frames where they were
+        memcpy((char*)stack.sptr - saved_stack.size(), saved_stack.data(), saved_stack.size());
+        saved_stack.clear();
+      }
+
+      // Someone else needs the shared stack. We are parked, so everything we
+      // use is between our saved context and the top of the stack
+      void leaveSharedStack() {
+        assert(parked);
+        auto sp = (const char*)ip.ctx;
+        auto top = (const char*)stack.sptr;
+        assert(sp < top && sp >= top - stack.ssize);
+        saved_stack.assign(sp, top);
+        shared_stacks[shared_idx].occupant = nullptr;
       }
       
       void epilogue() {
         markAsFree();
         wakeOthersWaitingForMe();
-        returnToCaller();
+        switchOut();
       }
 
       void markAsFree() {
         assert(state == RUNNING);
-        // This will invalidate the current version of the handle
-        this_handle.age++;
+        trace(TRACE_END, this_handle);
+        // This will invalidate the current version of the handle. Age 0
+        // is never used, so the default handle is always invalid
+        if (!++this_handle.age)
+          this_handle.age = 1;
         coros_free.push_back(this_handle);
         state = FREE;
+        --num_alive;
+        // Nothing in the shared stack is worth saving now
+        if (shared_idx >= 0) {
+          auto& ss = shared_stacks[shared_idx];
+          if (ss.occupant == this)
+            ss.occupant = nullptr;
+          std::vector< char >().swap(saved_stack);
+        }
       }
 
+      void prepareToRun() {
+        threadState().h_current = this_handle;
+        if (shared_idx >= 0)
+          enterSharedStack();
+        parked = false;
+#ifdef COROUTINES_PROFILING
+        ++stats.num_switches;
+        running_since = Time::now();
+#endif
+        trace(TRACE_RESUME, this_handle);
+      }
+
+      // Must be called with the sched lock taken, from the loop. We get back
+      // when the thread has nothing else to run, maybe from other coroutine
       void resume() {
-        h_current = this_handle;
-        ip = jump_fcontext(ip.ctx, ip.data);
+        int caller_lock_depth = threadState().lock_depth;
+        assert(caller_lock_depth > 0);
+        prepareToRun();
+        auto t = jump_fcontext(ip.ctx, nullptr);
+        threadState().lock_depth = caller_lock_depth;
+        landed(t);
       }
 
-      void returnToCaller() {
-        h_current = THandle();
-        caller_ctx = jump_fcontext(caller_ctx.ctx, caller_ctx.data);
+      // Must be called with the sched lock taken. Jumps directly to the next
+      // coroutine ready to run, or back to the loop. We might return in other thread
+      void switchOut() {
+        int my_lock_depth = threadState().lock_depth;
+        assert(my_lock_depth > 0);
+        fcontext_t to_ctx;
+        TCoro* next = direct_switching ? nextToRunDirectly(this) : nullptr;
+        if (next) {
+          next->prepareToRun();
+          to_ctx = next->ip.ctx;
+        }
+        else {
+          threadState().h_current = THandle();
+          to_ctx = threadState().loop_ctx;
+        }
+        auto t = jump_fcontext(to_ctx, this);
+        threadState().lock_depth = my_lock_depth;
+        landed(t);
       }
 
       void wakeOthersWaitingForMe() {
@@ -116,6 +355,14 @@ namespace Coroutines {
 
     };
 
+    // Used by the stack overflow handler
+    const fcontext_stack_t* currentStack() {
+      auto h = threadState().h_current;
+      if (h.id >= coros.size())
+        return nullptr;
+      return &coros[h.id].stack;
+    }
+
     // Implemented in events.cpp
     void attachToEvent(TEventID evt, TWatchedEvent* we);
     void detachFromEvent(TEventID evt, TWatchedEvent* we);
@@ -128,7 +375,7 @@ namespace Coroutines {
         return nullptr;
 
       // if what we found matches the current age, we are a valid co
-      TCoro* c = coros[h.id];
+      TCoro* c = &coros[h.id];
       assert(c->this_handle.id == h.id);
       if (h.age != c->this_handle.age)
         return nullptr;
@@ -136,19 +383,64 @@ namespace Coroutines {
     }
 
     // ----------------------------------------------------------
-    TCoro* findFree() {
+    // Runs after each jump in the context receiving it. Whoever jumped (the
+    // loop if t.data is null) has just been suspended in t.ctx
+    void landed(fcontext_transfer_t t) {
+      auto from = (TCoro*)t.data;
+      if (!from) {
+        threadState().loop_ctx = t.ctx;
+        return;
+      }
+      from->ip.ctx = t.ctx;
+      from->parked = true;
+#ifdef COROUTINES_PROFILING
+      from->stats.running_time += Time::now() - from->running_since;
+#endif
+
+      if (from->state == TCoro::FREE)
+        return;
+
+      trace(TRACE_SUSPEND, from->this_handle);
+
+      if (from->exit_requested) {
+        unregisterFromEvents(from);
+        from->markAsFree();
+        from->wakeOthersWaitingForMe();
+      }
+      else if (from->state == TCoro::RUNNING) {
+        // Has just yielded
+        enqueueRunnable(from);
+      }
+    }
+
+    // ----------------------------------------------------------
+    // Used by the io ring, the kernel can't write in a stack which is not in place
+    bool runsInSharedStack() {
+      TSchedLock lock;
+      auto co = byHandle(threadState().h_current);
+      return co && co->shared_idx >= 0;
+    }
+
+    // Also used by the io ring, only coroutines can sleep until the op completes
+    bool runsInOwnStack() {
+      TSchedLock lock;
+      auto co = byHandle(threadState().h_current);
+      return co && co->shared_idx < 0;
+    }
+
+    // ----------------------------------------------------------
+    TCoro* findFree(eStackSize stack_size) {
 
       TCoro* co = nullptr;
 
       // The list is empty?, create a new co
       if (coros_free.empty()) {
-        co = new TCoro;
+        auto idx = coros.size();
+        assert(idx != INVALID_ID);
+        co = &coros.grow();
         assert(co->state == TCoro::UNINITIALIZED);
-        auto  idx = coros.size();
-        co->this_handle.id = (uint16_t)idx;
+        co->this_handle.id = idx;
         co->this_handle.age = 1;
-        co->createStack();
-        coros.push_back(co);
       }
       else {
         // Else, use one of the free list
@@ -157,29 +449,40 @@ namespace Coroutines {
         assert(co);
         coros_free.pop_back();
         assert(co->state == TCoro::FREE);
-        assert(coros[co->this_handle.id] == co);
+        assert(&coros[co->this_handle.id] == co);
       }
 
+      co->setStack(stack_size);
       co->state = TCoro::RUNNING;
+      co->exit_requested = false;
+#ifdef COROUTINES_PROFILING
+      co->stats = TCoroStats();
+      co->stats.h = co->this_handle;
+#endif
+      ++num_alive;
       return co;
     }
 
     // --------------------------
-    THandle start(TBootFn&& boot_fn) {
+    THandle start(eStackSize stack_size, TBootFiller fill, void* user_fn) {
+
+      TSchedLock lock;
 
-      TCoro* co_new = findFree();
+      TCoro* co_new = findFree(stack_size);
       assert(co_new);                               // Run out of free coroutines slots
       assert(co_new->state == TCoro::RUNNING);
 
       // Save user entry point arguments
-      co_new->boot_fn = boot_fn;
+      fill(co_new->boot_fn, user_fn);
 
       co_new->resetIP();
 
       // Can't start the new co from another co. Just register it
       // and the main thread will take care of starting it when possible
-      if( !isHandle( current() ))
-        co_new->resume();
+      if (!multithreaded && !isHandle( current() ))
+        runOnce(co_new);
+      else
+        enqueueRunnable(co_new);
 
       return co_new->this_handle;
     }
@@ -189,11 +492,8 @@ namespace Coroutines {
       //printf("Dump FirstFree: %d LastFree:%d FirstInUse:%d - LastInUse:%d %s\n", first_free, last_free, first_in_use, last_in_use, title);
       printf("Dump %s\n", title);
       printf("  Size of Co(%d)\n", (int)sizeof( TCoro ));
-      int idx = 0;
-      for (auto& co : coros) {
-        printf("%04x : state:%d\n", idx, co->state);
-        ++idx;
-      }
+      for (uint32_t idx = 0; idx < coros.size(); ++idx)
+        printf("%04x : state:%d\n", idx, coros[idx].state);
     }
 
     // --------------------------------------------------------------
@@ -229,8 +529,18 @@ namespace Coroutines {
 
         case EVT_TIMEOUT: {
           registerTimeoutEvent(we);
+          if (we->time.time_to_trigger < poller_wakes_at)
+            kickPoller();
           break; }
 
+        case EVT_IO_COMPLETED:
+          // The ring already knows about us
+          break;
+
+        case EVT_SYNC_ACQUIRED:
+          we->sync.obj->addWaiter(we);
+          break;
+
         case EVT_CHANNEL_CAN_PULL: {
           auto c = TBaseChan::findChannelByHandle(we->channel.handle);
           assert(c);
@@ -255,6 +565,11 @@ namespace Coroutines {
       co->nwatched_events = nwatched_events;
       co->state = internal::TCoro::WAITING_FOR_EVENT;
       co->event_waking_me_up = nullptr;
+#ifdef COROUTINES_PROFILING
+      co->waiting_since = Time::now();
+#endif
+      if (nwatched_events)
+        trace(TRACE_WAIT_BEGIN, co->this_handle, watched_events->event_type, nwatched_events);
     }
 
     // --------------------------------------------------------------
@@ -295,16 +610,36 @@ namespace Coroutines {
           unregisterTimeoutEvent(we);
           break;
 
+        case EVT_IO_COMPLETED:
+#ifdef COROUTINES_USE_IO_URING
+          // Only a coroutine leaving can have the op in flight. Its stack
+          // stays with the op, and a new one is acquired if the co is reused
+          if (internal::io_ring.cancel(we, co->stack, co->stack_size))
+            assert(co->exit_requested);
+#endif
+          break;
+
+        case EVT_SYNC_ACQUIRED:
+          we->sync.obj->removeWaiter(we);
+          // It was handed to us, but we are leaving for other reason
+          if (we->sync.granted && (co->event_waking_me_up != we || co->exit_requested)) {
+            we->sync.granted = false;
+            we->sync.obj->release(we->sync.mode);
+          }
+          break;
+
         case EVT_CHANNEL_CAN_PULL: {
+          // The channel might have been released while we slept
           auto c = TBaseChan::findChannelByHandle(we->channel.handle);
-          assert(c);
-          c->waiting_for_pull.detach(we);
+          if (c)
+            c->waiting_for_pull.detach(we);
           break; }
 
         case EVT_CHANNEL_CAN_PUSH: {
+          // The channel might have been released while we slept
           auto c = TBaseChan::findChannelByHandle(we->channel.handle);
-          assert(c);
-          c->waiting_for_push.detach(we);
+          if (c)
+            c->waiting_for_push.detach(we);
           break; }
 
         default:
@@ -327,34 +662,81 @@ namespace Coroutines {
 
   }
 
+  // --------------------------------------------
+  bool getCoroStats(THandle h, TCoroStats& stats) {
+#ifdef COROUTINES_PROFILING
+    internal::TSchedLock lock;
+    auto co = internal::byHandle(h);
+    if (!co)
+      return false;
+    stats = co->stats;
+    return true;
+#else
+    (void)h;
+    (void)stats;
+    return false;
+#endif
+  }
+
+  std::vector< TCoroStats > topCoroutines(eCoroMetric metric, size_t n, eEventType evt) {
+    std::vector< TCoroStats > top;
+#ifdef COROUTINES_PROFILING
+    internal::TSchedLock lock;
+    for (uint32_t idx = 0; idx < internal::coros.size(); ++idx) {
+      auto& co = internal::coros[idx];
+      if (co.state != internal::TCoro::UNINITIALIZED && co.state != internal::TCoro::FREE)
+        top.push_back(co.stats);
+    }
+    auto value = [metric, evt](const TCoroStats& s) -> int64_t {
+      switch (metric) {
+      case METRIC_RUNNING_TIME: return s.running_time.count();
+      case METRIC_NUM_SWITCHES: return (int64_t)s.num_switches;
+      default:
+        if (evt < EVT_INVALID)
+          return s.waiting_time[evt].count();
+        return s.totalWaitingTime().count();
+      }
+    };
+    n = std::min(n, top.size());
+    std::partial_sort(top.begin(), top.begin() + n, top.end(), [&value](const TCoroStats& a, const TCoroStats& b) {
+      return value(a) > value(b);
+    });
+    top.resize(n);
+#else
+    (void)metric;
+    (void)n;
+    (void)evt;
+#endif
+    return top;
+  }
+
   // --------------------------
   THandle current() {
-    return internal::h_current;
+    return internal::threadState().h_current;
   }
 
   // --------------------------------------------
   bool isHandle(THandle h) {
+    internal::TSchedLock lock;
     return internal::byHandle(h) != nullptr;
   }
 
-  THandle start(TBootFn&& user_fn) {
-    return internal::start(std::forward<TBootFn>(user_fn));
-  }
-
 	size_t getNumLoops() {
 		return internal::num_loops;
 	}
 
   // --------------------------------------------
   void yield() {
+    internal::TSchedLock lock;
     assert(isHandle( current() ));
     auto co = internal::byHandle(current());
     assert(co);
-    co->returnToCaller();
+    co->switchOut();
   }
 
   // --------------------------------------------
   void exitCo(THandle h) {
+    internal::TSchedLock lock;
     auto co = internal::byHandle(h);
     if (!co)
       return;
@@ -363,7 +745,13 @@ namespace Coroutines {
       if (co)
         co->epilogue();
     }
+    else if (!co->parked) {
+      // It's running in other thread. The thread will finish it when it returns
+      co->exit_requested = true;
+    }
     else {
+      // So it doesn't keep what was handed to it while sleeping
+      co->exit_requested = true;
       internal::unregisterFromEvents(co);
       co->markAsFree();
       co->wakeOthersWaitingForMe();
@@ -410,17 +798,36 @@ namespace Coroutines {
         break; }
 
       case EVT_CHANNEL_CAN_PULL: {
+        // A released channel behaves like a closed one
         auto c = internal::TBaseChan::findChannelByHandle(we->channel.handle);
-        if (c && (!c->empty() || c->closed()))
+        if (!c || !c->empty() || c->closed())
           return idx;
         break; }
 
       case EVT_CHANNEL_CAN_PUSH: {
         auto c = internal::TBaseChan::findChannelByHandle(we->channel.handle);
-        if (c && (!c->full() && !c->closed()))
+        if (!c || (!c->full() && !c->closed()))
           return idx;
         break; }
 
+      case EVT_SOCKET_IO_CAN_READ:
+      case EVT_SOCKET_IO_CAN_WRITE:
+        if (internal::io_events.isReady(we))
+          return idx;
+        break;
+
+      case EVT_IO_COMPLETED:
+        if (we->ring.slot == TWatchedEvent::ring_completed)
+          return idx;
+        break;
+
+      case EVT_SYNC_ACQUIRED:
+        if (we->sync.obj->tryAcquire(we->sync.mode)) {
+          we->sync.granted = true;
+          return idx;
+        }
+        break;
+
       default:
         break;
       }
@@ -431,8 +838,90 @@ namespace Coroutines {
     return -1;
   }
 
+  namespace internal {
+
+    // Registers the coroutine in the events and sleeps until one of them
+    // wakes it up. Returns the index of that event.
+    // Must be called with the sched lock taken
+    int sleepOnEvents(TCoro* co, TWatchedEvent* watched_events, int nwatched_events) {
+      // While we sleep, our stack might not be in place. Others can only
+      // see a copy of the events
+      TWatchedEvent* registered_events = watched_events;
+      if (co->shared_idx >= 0) {
+        co->saved_events.assign(watched_events, watched_events + nwatched_events);
+        registered_events = co->saved_events.data();
+      }
+
+      registerToEvents(co, registered_events, nwatched_events);
+
+      yield();
+
+      // There should be a reason to exit the waiting_for_event
+      assert(co->event_waking_me_up != nullptr);
+
+      int event_idx = unregisterFromEvents(co);
+      if (registered_events != watched_events)
+        std::copy(registered_events, registered_events + nwatched_events, watched_events);
+      return event_idx;
+    }
+
+    // --------------------------------------------------------------
+    int waitForSignal(const TWatchedEvent* sources, int nsources, TTimeDelta timeout) {
+      assert(sources && nsources > 0);
+
+      TSchedLock lock;
+      auto co = byHandle(current());
+      assert(co);
+
+      // Closed channels will not signal again, and the released ones can't
+      // be watched. Sleeping on them could last forever
+      for (int i = 0; i < nsources; ++i) {
+        auto& s = sources[i];
+        if (s.event_type == EVT_CHANNEL_CAN_PULL || s.event_type == EVT_CHANNEL_CAN_PUSH) {
+          auto c = TBaseChan::findChannelByHandle(s.channel.handle);
+          if (!c || c->closed())
+            return -1;
+        }
+      }
+
+      const int max_local_events = 8;
+      TWatchedEvent local_wes[max_local_events];
+      std::vector< TWatchedEvent > heap_wes;
+      int nevents = nsources + (timeout != no_timeout ? 1 : 0);
+      TWatchedEvent* wes = local_wes;
+      if (nevents > max_local_events) {
+        heap_wes.resize(nevents);
+        wes = heap_wes.data();
+      }
+
+      int n = 0;
+      for (; n < nsources; ++n) {
+        wes[n] = sources[n];
+        wes[n].owner = current();
+      }
+      if (timeout != no_timeout)
+        wes[n++] = TWatchedEvent(timeout);
+
+      int idx = sleepOnEvents(co, wes, n);
+      if (idx < 0 || idx >= nsources)
+        return -1;
+      return idx;
+    }
+
+    void passSignal(const TWatchedEvent& source) {
+      if (source.event_type != EVT_CHANNEL_CAN_PULL && source.event_type != EVT_CHANNEL_CAN_PUSH)
+        return;
+      TSchedLock lock;
+      if (auto c = TBaseChan::findChannelByHandle(source.channel.handle))
+        c->passWakeUp(source.event_type);
+    }
+
+  }
+
   // --------------------------------------------------------------
   int wait(TWatchedEvent* watched_events, int nwatched_events ) {
+
+    internal::TSchedLock lock;
     
     // Main thread can't wait for other co to finish
     assert(isHandle(current()));
@@ -444,202 +933,349 @@ namespace Coroutines {
     if ( idx >= 0)
       return idx;
 
-    internal::registerToEvents(co, watched_events, nwatched_events);
-
-    yield();
-
-    // There should be a reason to exit the waiting_for_event
-    assert(co->event_waking_me_up != nullptr);
-
-    int event_idx = internal::unregisterFromEvents(co);
-    return event_idx;
+    return internal::sleepOnEvents(co, watched_events, nwatched_events);
   }
 
   // ---------------------------------------------------
   // Try to wake up all the coroutines which were waiting for the event
   void wakeUp(TWatchedEvent* we) {
     assert(we);
+    internal::TSchedLock lock;
+    if (we->in_selector) {
+      internal::selectorSourceReady(we);
+      return;
+    }
     auto co = internal::byHandle(we->owner);
     if (co) {
+#ifdef COROUTINES_PROFILING
+      // Only the first event ends the wait
+      if (co->state == internal::TCoro::WAITING_FOR_EVENT)
+        co->stats.waiting_time[we->event_type] += Time::now() - co->waiting_since;
+#endif
+      if (internal::isTracing() && co->state == internal::TCoro::WAITING_FOR_EVENT)
+        internal::recordTrace(internal::TRACE_WAIT_END, co->this_handle, we->event_type, internal::traceArgOf(we));
       co->event_waking_me_up = we;
       co->state = internal::TCoro::RUNNING;
+      if (co->parked)
+        internal::enqueueRunnable(co);
     }
   }
 
-  // ---------------------------------------------------
-  void internal::TIOEvents::add(TWatchedEvent* we) {
-
-    assert(we);
-    assert(we->event_type == EVT_SOCKET_IO_CAN_READ || we->event_type == EVT_SOCKET_IO_CAN_WRITE);
-
-    auto fd = we->io.fd;
-    auto mode = we->event_type == EVT_SOCKET_IO_CAN_READ ? TO_READ : TO_WRITE;
-
-    auto e = find(fd);
+  // ----------------------------------------------------------
+  namespace internal {
 
-    assert(e && e->fd == fd);
-    if (mode == TO_READ) {
-      e->mask |= TO_READ;
-      e->waiting_to_read.append(we);
-      FD_SET(fd, &rfds);
-    }
-    else {
-      e->mask |= TO_WRITE;
-      e->waiting_to_write.append(we);
-      FD_SET(fd, &wfds);
+    // Must be called with the sched lock taken
+    void pollEvents() {
+      deliverPostedWakeUps();
+      io_events.update();
+#ifdef COROUTINES_USE_IO_URING
+      io_ring.update();
+#endif
+      checkTimeoutEvents();
     }
 
-    FD_SET(fd, &err_fds);
+    // Sleeps in the io backend until there is io activity, the next timeout
+    // expires, the deadline arrives or someone kicks us.
+    // Must be called with the sched lock taken
+    void waitForEvents(TTimeStamp deadline) {
+#ifdef COROUTINES_USE_IO_URING
+      // Completions also end the sleep
+      static bool ring_watched = false;
+      if (!ring_watched && io_ring.isAvailable())
+        io_events.watchForWakeUp(io_ring.fd());
+      ring_watched = true;
+      if (io_ring.update() > 0)
+        return;
+#endif
+      auto now = Time::now();
+      if (deadline <= now)
+        return;
+      auto max_wait = timeToNextTimeout(now);
+      if (deadline - now < max_wait)
+        max_wait = deadline - now;
+      if (max_wait <= TTimeDelta::zero())
+        return;
+
+      poller_blocked = true;
+      poller_interrupted = false;
+      poller_wakes_at = TTimeStamp::max();
+      if (max_wait != TTimeDelta::max())
+        poller_wakes_at = now + max_wait;
+      io_events.update(max_wait);
+      poller_blocked = false;
+      poller_wakes_at = TTimeStamp();
+    }
 
-    if (fd > max_fd)
-      max_fd = fd;
   }
 
-  // ---------------------------------------------------
-  void internal::TIOEvents::del(TWatchedEvent* we) {
-
-    assert(we);
-    assert(we->event_type == EVT_SOCKET_IO_CAN_READ || we->event_type == EVT_SOCKET_IO_CAN_WRITE);
-
-    auto fd = we->io.fd;
-    auto mode = we->event_type == EVT_SOCKET_IO_CAN_READ ? TO_READ : TO_WRITE;
-
-    auto e = find(fd);
-
-    if (!e || e->mask == 0)
-      return;
+  // ----------------------------------------------------------
+  int executeActives() {
+    assert(!internal::multithreaded);
+    internal::threadState().runs_loop = true;
+    internal::TSchedLock lock;
+		internal::num_loops++;
+    internal::pollEvents();
+    return internal::runActives();
+  }
 
-    assert(e && e->fd == fd);
-    e->mask &= (~mode);
+  // ----------------------------------------------------------
+  int runUntilIdle() {
+    int num_alive = 0;
+    do {
+      num_alive = executeActives();
+    } while (num_alive && !internal::ready.empty());
+    return num_alive;
+  }
 
-    if (mode == TO_READ) {
-      FD_CLR(fd, &rfds);
-      e->waiting_to_read.detach(we);
-    }
-    else {
-      FD_CLR(fd, &wfds);
-      e->waiting_to_write.detach(we);
+  // ----------------------------------------------------------
+  int run(TTimeStamp deadline) {
+    assert(!isHandle(current()));
+    int num_alive = 0;
+    while ((num_alive = executeActives()) > 0) {
+      if (Time::now() >= deadline)
+        break;
+      internal::TSchedLock lock;
+      if (internal::ready.empty())
+        internal::waitForEvents(deadline);
     }
+    return num_alive;
+  }
 
-    FD_CLR(fd, &err_fds);
-
-    assert(e && e->fd == fd);
-
-    // Are we removing the largest fd we have?
-    if (e->mask == 0 && e->fd == max_fd) {
-      // Update max_fd when we remove the largest fd defined
-      max_fd = 0;
-      for (auto& e : entries) {
-        if (e.mask && e.fd > max_fd)
-          max_fd = e.fd;
-      }
-    }
+  // --------------------------------------------
+  int internal::runActives() {
 
-    SOCKET_ID new_max_fd = 0;
-    for (auto ne : entries) {
-      if (ne.mask != 0 && ne.fd > new_max_fd)
-        new_max_fd = ne.fd;
+    // Coroutines becoming ready while we run these will run in the next loop,
+    // unless they are reached by a direct switch
+    assert(ready_this_loop.empty());
+    ready_this_loop = ready;
+    ready = TList();
+
+    // The coroutines switch directly between them, so we only get back
+    // here when they block and the next one can't run directly
+    direct_switches_left = max_direct_switches_per_loop;
+    while (auto co = ready_this_loop.detachFirst< TCoro >()) {
+      co->queued = false;
+      // It might have been destroyed after being queued
+      if (co->state != TCoro::RUNNING)
+        continue;
+      runOnce(co);
     }
-    assert(new_max_fd == max_fd);
+    direct_switches_left = 0;
 
+    // Those waiting for events are also active
+    return num_alive;
   }
 
-  int internal::TIOEvents::update() {
+  // --------------------------------------------
+  // Must be called with the sched lock taken. The coroutine which runs last
+  // does the bookkeeping of the one leaving in landed
+  void internal::runOnce(TCoro* co) {
+    co->resume();
+  }
 
-    // Amount of time to wait
-    timeval tm;
-    tm.tv_sec = 0;
-    tm.tv_usec = 0;
+  // --------------------------------------------
+  // M:N mode
+  // --------------------------------------------
+  namespace internal {
 
-    fd_set fds_to_read, fds_to_write;
-    fd_set fds_with_err;
+    struct TWorker {
+      std::deque< TCoro* > runnables;
+      std::deque< TCoro* > pinned;        // In our shared stacks, can't be stolen
+      uint32_t             num_pops = 0;
+      bool hasWork() const { return !runnables.empty() || !pinned.empty(); }
+    };
 
-    memcpy(&fds_to_read, &rfds, sizeof(fd_set));
-    memcpy(&fds_to_write, &wfds, sizeof(fd_set));
-    memcpy(&fds_with_err, &err_fds, sizeof(fd_set));
+    std::vector< TWorker >  workers;
+    std::condition_variable work_available;
+    int                     num_sleeping_workers = 0;   // Waiting in work_available
+
+    // Must be called with the sched lock taken. In M:N mode, new work goes to
+    // the queue of the thread producing it, so it tends to stay in the same core.
+    void enqueueRunnable(TCoro* co) {
+      if (co->queued)
+        return;
+      co->queued = true;
+      if (!multithreaded) {
+        ready.append(co);
+        return;
+      }
+      int idx = threadState().worker_idx;
+      if (idx < 0)
+        idx = 0;
+      if (co->shared_idx >= 0) {
+        // It can only run in the thread owning its shared stack
+        int owner = co->shared_idx % (int)workers.size();
+        workers[owner].pinned.push_back(co);
+        if (owner != idx) {
+          work_available.notify_all();
+          kickPoller();
+        }
+        return;
+      }
+      workers[idx].runnables.push_back(co);
+      // When nobody is waiting for work, wake up the one waiting for io
+      if (num_sleeping_workers)
+        work_available.notify_one();
+      else
+        kickPoller();
+    }
 
-    // Do a real wait
-    int num_events = 0;
-    auto retval = ::select((int)(max_fd + 1), &fds_to_read, &fds_to_write, &fds_with_err, &tm);
-    if (retval > 0) {
+    // Take from our own queues, or move half of the queue of another worker
+    // to ours. The sched lock is taken, so the queues don't need their own
+    TCoro* popRunnable(int idx) {
+      auto& w = workers[idx];
+      auto& mine = w.runnables;
+      // Alternate with the pinned ones, so neither queue starves
+      if (!w.pinned.empty() && (mine.empty() || (++w.num_pops & 1))) {
+        TCoro* co = w.pinned.front();
+        w.pinned.pop_front();
+        co->queued = false;
+        return co;
+      }
+      if (mine.empty()) {
+        int nworkers = (int)workers.size();
+        for (int i = 1; i < nworkers; ++i) {
+          auto& victim = workers[(idx + i) % nworkers].runnables;
+          size_t nmoved = (victim.size() + 1) / 2;
+          while (nmoved--) {
+            mine.push_back(victim.back());
+            victim.pop_back();
+          }
+          if (!mine.empty())
+            break;
+        }
+        if (mine.empty())
+          return nullptr;
+      }
+      TCoro* co = mine.front();
+      mine.pop_front();
+      co->queued = false;
+      return co;
+    }
 
-      for (auto& e : entries) {
+    // --------------------------------------------
+    // The coroutine leaving can jump directly to the next one, unless the
+    // next one needs the shared stack we are still running in. In single
+    // thread mode, those woken up during the loop can also run directly,
+    // until the loop has to poll again
+    TCoro* nextToRunDirectly(TCoro* from) {
+      if (!multithreaded) {
+        if (direct_switches_left <= 0)
+          return nullptr;
+        --direct_switches_left;
+        if (ready_this_loop.empty()) {
+          ready_this_loop = ready;
+          ready = TList();
+        }
+        while (auto co = static_cast<TCoro*>(ready_this_loop.first)) {
+          if (co->state == TCoro::RUNNING && co->shared_idx >= 0 && co->shared_idx == from->shared_idx)
+            return nullptr;
+          ready_this_loop.detach(co);
+          co->queued = false;
+          if (co->state == TCoro::RUNNING)
+            return co;
+        }
+        return nullptr;
+      }
 
-        if (!e.mask)
+      int idx = threadState().worker_idx;
+      if (idx < 0)
+        return nullptr;
+      while (auto co = popRunnable(idx)) {
+        if (co->state != TCoro::RUNNING)
           continue;
-
-        if (FD_ISSET(e.fd, &fds_with_err))
-          printf("Socket %d has errors\n", (int)e.fd);
-
-        // we were waiting a read op, and we can read now...
-        if (((e.mask & TO_READ) && FD_ISSET(e.fd, &fds_to_read)) || FD_ISSET(e.fd, &fds_with_err)) {
-          auto we = e.waiting_to_read.detachFirst< TWatchedEvent >();
-          if (we) {
-            assert(we->io.fd == e.fd);
-            assert(we->event_type == EVT_SOCKET_IO_CAN_READ);
-            wakeUp(we);
-          }
+        if (co->shared_idx >= 0 && co->shared_idx == from->shared_idx) {
+          // Only we can run it, let the loop do it
+          co->queued = true;
+          workers[idx].pinned.push_front(co);
+          return nullptr;
         }
+        ++num_loops;
+        return co;
+      }
+      return nullptr;
+    }
 
-        if (((e.mask & TO_WRITE) && FD_ISSET(e.fd, &fds_to_write)) || FD_ISSET(e.fd, &fds_with_err)) {
-          auto we = e.waiting_to_write.detachFirst< TWatchedEvent >();
-          if (we) {
-            assert(we->io.fd == e.fd);
-            assert(we->event_type == EVT_SOCKET_IO_CAN_WRITE);
-            wakeUp(we);
+    // --------------------------------------------
+    void runWorker(int idx) {
+      threadState().worker_idx = idx;
+      attachTraceRingOfWorker(idx);
+      TStackPools::installOverflowHandler();
+      TSchedLock lock;
+
+      while (num_alive > 0) {
+
+        TCoro* co = popRunnable(idx);
+        if (!co) {
+          // One idle thread polls & sleeps waiting for io and timeouts. When
+          // it wakes up, let another idle thread take its place
+          if (!poller_blocked) {
+            pollEvents();
+            if (workers[idx].hasWork())
+              continue;
+            waitForEvents(TTimeStamp::max());
+            if (num_sleeping_workers)
+              work_available.notify_one();
+            continue;
           }
+          // The others sleep until someone enqueues work
+          std::unique_lock< std::mutex > ul(sched_mutex, std::adopt_lock);
+          ++num_sleeping_workers;
+          work_available.wait(ul);
+          --num_sleeping_workers;
+          ul.release();
+          continue;
         }
 
+        // The queue can hold coroutines which were destroyed after being queued
+        if (co->state != TCoro::RUNNING)
+          continue;
+
+        ++num_loops;
+        runOnce(co);
       }
-    }
-    return num_events;
-  }
 
+      // Let the others know we are done
+      work_available.notify_all();
+      kickPoller();
+      threadState().worker_idx = -1;
+    }
 
-  // ----------------------------------------------------------
-  int executeActives() {
-		internal::num_loops++;
-    internal::io_events.update();
-    internal::checkTimeoutEvents();
-    return internal::runActives();
   }
 
   // --------------------------------------------
-  int internal::runActives() {
-
-    int nactives = 0;
-
-    // coros can be enlarged inside the loop, watch the iterator
-    // don't become invalidated
-    size_t i = 0;
-    while (i < coros.size()) {
-      auto co = coros[i];
-      ++i;
-      assert(co);
-      
-      // Skip the free's
-      if (co->state == TCoro::FREE)
-        continue;
-
-      else if (co->state == TCoro::WAITING_FOR_EVENT) {
-        ++nactives;
-        continue;
-      }
+  void enableDirectSwitching(bool how) {
+    internal::direct_switching = how;
+  }
 
-      else {
-        assert(co->state == TCoro::RUNNING);
+  // --------------------------------------------
+  void runInThreads(int nthreads) {
+    using namespace internal;
+    assert(nthreads > 0);
+    assert(!isHandle(current()));
+    assert(!multithreaded);
+
+    workers.resize(nthreads);
+    multithreaded = true;
+
+    // Pick up the coroutines left ready by the single thread mode
+    {
+      TSchedLock lock;
+      while (auto co = ready.detachFirst< TCoro >()) {
+        co->queued = false;
+        enqueueRunnable(co);
       }
-      
-      co->resume();
-
-      if ( co->state == TCoro::RUNNING 
-        || co->state == TCoro::WAITING_FOR_EVENT       // If by resuming we become WaitingForEvent, we are in fact an active co
-        )
-        ++nactives;
-
     }
 
-    return nactives;
+    std::vector< std::thread > threads;
+    for (int i = 1; i < nthreads; ++i)
+      threads.emplace_back(runWorker, i);
+    runWorker(0);
+    for (auto& t : threads)
+      t.join();
+
+    multithreaded = false;
+    workers.clear();
   }
 
 }
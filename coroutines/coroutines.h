@@ -3,8 +3,13 @@
 
 #include <cinttypes>
 #include <cassert>
+#include <cstddef>
 #include <cstring>
 #include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "timeline.h"
 
 namespace Coroutines {
 
@@ -16,17 +21,100 @@ namespace Coroutines {
   struct TWatchedEvent;
 
   // --------------------------------------------------
+  // id is the slot of the coroutine, and age counts the coroutines which
+  // have used the slot, so the handles of the finished ones become stale
   struct THandle {
-    uint16_t id = 0;
-    uint16_t age = 0;
+    uint32_t id = 0;
+    uint32_t age = 0;
     bool operator==(const THandle& other) const { return id == other.id && age == other.age; }
-    uint32_t asUnsigned() const { return (age << 16 ) | id; }
+    uint64_t asUnsigned() const { return ((uint64_t)age << 32) | id; }
   };
 
   typedef std::function<void(void)> TBootFn;
 
+  // --------------------------------------------------
+  // Size of the stack reserved for the coroutine
+  enum eStackSize {
+    STACK_TINY = 0          // 8Kb, for small handlers
+  , STACK_SMALL             // 32Kb
+  , STACK_DEFAULT           // 64Kb
+  , STACK_LARGE             // 256Kb
+  , STACK_HUGE              // 1Mb, for deep recursions
+  , STACK_SHARED            // Runs in a 256Kb stack shared with others. Only the
+                            // used part is saved when others need the stack
+  , STACK_SIZES_COUNT
+  };
+
+  // --------------------------------------------------
+  namespace internal {
+
+    // Entry point of a coroutine. Callables up to inline_size bytes are
+    // stored in place, so starting a coroutine doesn't allocate. The
+    // bigger ones are moved to the heap
+    class TBootCallable {
+    public:
+      static const size_t inline_size = 48;
+
+    private:
+      typedef void(*TCallFn)(void* obj);
+
+      alignas(std::max_align_t) unsigned char buffer[inline_size];
+      void*   obj = nullptr;          // In the buffer or in the heap
+      TCallFn invoke_fn = nullptr;
+      TCallFn destroy_fn = nullptr;
+
+    public:
+
+      TBootCallable() = default;
+      TBootCallable(const TBootCallable&) = delete;
+      TBootCallable& operator=(const TBootCallable&) = delete;
+      ~TBootCallable() { reset(); }
+
+      template< typename F >
+      void assign(F&& fn) {
+        typedef typename std::decay<F>::type TFn;
+        reset();
+        if (sizeof(TFn) <= inline_size && alignof(TFn) <= alignof(std::max_align_t)) {
+          obj = buffer;
+          new (obj) TFn(std::forward<F>(fn));
+          destroy_fn = [](void* p) { ((TFn*)p)->~TFn(); };
+        }
+        else {
+          obj = new TFn(std::forward<F>(fn));
+          destroy_fn = [](void* p) { delete (TFn*)p; };
+        }
+        invoke_fn = [](void* p) { (*(TFn*)p)(); };
+      }
+
+      void reset() {
+        if (!obj)
+          return;
+        destroy_fn(obj);
+        obj = nullptr;
+      }
+
+      explicit operator bool() const { return obj != nullptr; }
+      void operator()() { invoke_fn(obj); }
+    };
+
+    // Reserves a coroutine, calls fill to store the user_fn in it, and starts it
+    typedef void(*TBootFiller)(TBootCallable& boot, void* user_fn);
+    THandle start(eStackSize stack_size, TBootFiller fill, void* user_fn);
+  }
+
   // --------------------------
-  THandle start(TBootFn&& user_fn);
+  // Accepts any callable without arguments. It's moved or copied directly
+  // to the coroutine
+  template< typename F >
+  THandle start(F&& user_fn, eStackSize stack_size = STACK_DEFAULT) {
+    struct TArg {
+      F&& fn;
+    };
+    TArg arg{ std::forward<F>(user_fn) };
+    return internal::start(stack_size, [](internal::TBootCallable& boot, void* p) {
+      boot.assign(std::forward<F>(((TArg*)p)->fn));
+    }, &arg);
+  }
 
   // --------------------------------------------------
   bool    isHandle(THandle h);
@@ -38,6 +126,27 @@ namespace Coroutines {
   int     executeActives();
 	size_t  getNumLoops();
 
+  // Runs coroutines until none is ready to run, without blocking. Returns
+  // the number of coroutines alive
+  int     runUntilIdle();
+
+  // Runs until all the coroutines have finished or the deadline arrives.
+  // When nobody is ready to run, the thread sleeps until the next io event
+  // or timeout. Returns the number of coroutines alive
+  int     run(TTimeStamp deadline = TTimeStamp::max());
+
+  // When a coroutine blocks, it jumps directly to the next one ready to run
+  // instead of going back to the loop first. Enabled by default
+  void    enableDirectSwitching(bool how);
+
+  // --------------------------------------------------
+  // Opt-in M:N mode. Runs the coroutines in nthreads OS threads (the calling
+  // thread is one of them) until all the coroutines have finished.
+  // Each thread owns a run queue, and takes half of the queue of another
+  // one when its own is empty. The scheduler state is guarded by one lock,
+  // so the threads only run in parallel the code between two switches.
+  void    runInThreads(int nthreads);
+
   // --------------------------------------------------
   void    wakeUp(TWatchedEvent* we);
   typedef std::function<bool(void)> TWaitConditionFn;
@@ -51,20 +160,46 @@ namespace Coroutines {
   , EVT_SOCKET_IO_CAN_WRITE
   , EVT_CHANNEL_CAN_PUSH
   , EVT_CHANNEL_CAN_PULL
+  , EVT_IO_COMPLETED
+  , EVT_SYNC_ACQUIRED
   , EVT_INVALID
   , EVT_TYPES_COUNT
   };
 
+  // --------------------------------------------------
+  namespace internal {
+
+    // Serializes the access to the scheduler state (coroutines, channels,
+    // events, timers...) while running in runInThreads. When running in a
+    // single thread it only keeps track of the nesting depth.
+    struct TSchedLock {
+      TSchedLock();
+      ~TSchedLock();
+    };
+
+    // Releases the sched lock of the thread while sleeping in a syscall
+    struct TSchedUnlock {
+      int saved_depth;
+      TSchedUnlock();
+      ~TSchedUnlock();
+    };
+
+  }
+
 }
 
 #include "channel_handle.h"
 #include "list.h"
-#include "timeline.h"
 #include "io_events.h"
 #include "events.h"
 #include "io_channel.h"
 #include "wait.h"
+#include "locks.h"
+#include "profiling.h"
+#include "trace.h"
 #include "channel.h"
+#include "channel_mpmc.h"
 #include "choose.h"
+#include "selector.h"
 
 #endif
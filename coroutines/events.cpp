@@ -1,6 +1,6 @@
 #include "coroutines.h"
 #include "events.h"
-#include <unordered_map>
+#include <vector>
 
 namespace Coroutines {
 
@@ -8,34 +8,39 @@ namespace Coroutines {
 
     // Internal data associated to each event
     struct TEventData {
-      TEventID     id = 0;
+      uint32_t     age = 0;
+      bool         in_use = false;
       bool         current_value = false;
       const char*  name = nullptr;
       TList        waiting_for_me;
     };
 
-    // Container of all events 
-    std::unordered_map< TEventID, TEventData > all_events;
-    
-    // EventID unique ID counter
-    TEventID next_event_id = 1;
+    // Container of all events. The low 32 bits of the TEventID are the
+    // index in the table, and the high 32 bits the age of the slot, so the
+    // ids of destroyed events are rejected once the slot is reused
+    std::vector< TEventData > all_events;
+    std::vector< uint32_t >   free_events;
+
+    TEventData* eventByID(TEventID evt) {
+      uint32_t idx = (uint32_t)evt;
+      if (idx >= all_events.size())
+        return nullptr;
+      auto& ed = all_events[idx];
+      return (ed.in_use && ed.age == (uint32_t)(evt >> 32)) ? &ed : nullptr;
+    }
 
     // Bind the evt with the watched event object
     void attachToEvent(TEventID evt, TWatchedEvent* we) {
       assert(we);
-      auto it = all_events.find(evt);
-      if (it == all_events.end())
-        return;
-      it->second.waiting_for_me.append(we);
+      if (auto ed = eventByID(evt))
+        ed->waiting_for_me.append(we);
     }
     
     // Reverse the operation, we is no longer watching the evt
     void detachFromEvent(TEventID evt, TWatchedEvent* we) {
       assert(we);
-      auto it = all_events.find(evt);
-      if (it == all_events.end())
-        return;
-      it->second.waiting_for_me.detach(we);
+      if (auto ed = eventByID(evt))
+        ed->waiting_for_me.detach(we);
     }
 
     void wakeUpThoseWaitingForEvent(TEventData& ed) {
@@ -48,59 +53,75 @@ namespace Coroutines {
 
   using namespace internal;
 
-  // Create a new entry & save the information
+  // Take a free slot & save the information
   TEventID createEvent(bool initial_value, const char* debug_name ) {
-    TEventData ed;
-    ed.id = next_event_id++;
+    TSchedLock lock;
+    uint32_t idx;
+    if (free_events.empty()) {
+      idx = (uint32_t)all_events.size();
+      all_events.emplace_back();
+    }
+    else {
+      idx = free_events.back();
+      free_events.pop_back();
+    }
+    auto& ed = all_events[idx];
+    // Age 0 is never used, so the id 0 is always invalid
+    if (!++ed.age)
+      ed.age = 1;
+    ed.in_use = true;
     ed.current_value = initial_value;
     ed.name = debug_name;
-    all_events[ed.id] = ed;
-    return ed.id;
+    return ((TEventID)ed.age << 32) | idx;
   }
 
   // By setting the event, everybody waiting for me is awakend
   bool setEvent(TEventID evt) {
-    auto it = all_events.find(evt);
-    if (it == all_events.end())
+    TSchedLock lock;
+    auto ed = eventByID(evt);
+    if (!ed)
       return false;
-    auto& ed = it->second;
     
-    ed.current_value = true;
+    ed->current_value = true;
 
-    wakeUpThoseWaitingForEvent(ed);
+    wakeUpThoseWaitingForEvent(*ed);
 
     return true;
   }
 
   bool clearEvent(TEventID evt) {
-    auto it = all_events.find(evt);
-    if (it == all_events.end())
+    TSchedLock lock;
+    auto ed = eventByID(evt);
+    if (!ed)
       return false;
-    it->second.current_value = false;
+    ed->current_value = false;
     return true;
   }
 
   bool isEventSet(TEventID evt) {
-    auto it = all_events.find(evt);
-    if (it == all_events.end())
-      return false;
-    return it->second.current_value;
+    TSchedLock lock;
+    auto ed = eventByID(evt);
+    return ed && ed->current_value;
   }
 
   bool destroyEvent(TEventID evt) {
-    auto it = all_events.find(evt);
-    if (it == all_events.end())
+    TSchedLock lock;
+    auto ed = eventByID(evt);
+    if (!ed)
       return false;
     
     // Wake up anybody waiting for me
-    wakeUpThoseWaitingForEvent(it->second);
+    wakeUpThoseWaitingForEvent(*ed);
 
-    all_events.erase(it);
+    ed->in_use = false;
+    ed->name = nullptr;
+    free_events.push_back((uint32_t)evt);
     return true;
   }
 
   bool isValidEvent(TEventID evt) {
-    return all_events.find(evt) != all_events.end();
+    TSchedLock lock;
+    return eventByID(evt) != nullptr;
   }
 
 
@@ -3,7 +3,8 @@
 
 namespace Coroutines {
 
-  typedef uint32_t TEventID;
+  // Index of the event in the low 32 bits, and age of the slot in the high ones
+  typedef uint64_t TEventID;
 
   TEventID createEvent( bool initial_value = false, const char* debug_name = nullptr );
   bool setEvent(TEventID evt);
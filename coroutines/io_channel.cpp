@@ -1,6 +1,9 @@
 #define _CRT_SECURE_NO_WARNINGS
 #include "coroutines.h"
 #include "wait.h"
+#include "io_ring.h"
+#include <algorithm>
+#include <cstdio>
 
 extern void dbg(const char *fmt, ...);
 //#define dbg(...)
@@ -25,6 +28,8 @@ extern void dbg(const char *fmt, ...);
 
 #include <sys/types.h>
 #include <sys/uio.h>
+#include <sys/socket.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -80,6 +85,227 @@ namespace Coroutines {
         return sock_err;
       }
 
+      // ---------------------------------------------------------------------------
+      // The op on the socket returned EWOULDBLOCK. With edge triggered events
+      // the readiness remembered is stale now, so it's dropped and the op is
+      // retried, as it might have become ready after the op failed. Only
+      // when there was none we sleep until the socket has new activity
+      void waitIO(TSocket sock, bool to_write) {
+        using namespace Coroutines::internal;
+        {
+          TSchedLock lock;
+          if (io_events.clearReady(sock.s, to_write ? TIOEvents::TO_WRITE : TIOEvents::TO_READ))
+            return;
+        }
+        wait(to_write ? canWrite(sock) : canRead(sock));
+      }
+
+      // The op succeeded, but a choose or a selector should not fire again
+      // for the socket if there is nothing else to take from it
+      void checkDrained(TSocket sock, bool to_write) {
+        using namespace Coroutines::internal;
+        TSchedLock lock;
+        io_events.clearReadyIfDrained(sock.s, to_write ? TIOEvents::TO_WRITE : TIOEvents::TO_READ);
+      }
+
+      // ---------------------------------------------------------------------------
+      // Buffers set by registerBuffers
+      struct TFixedBuffer {
+        void*  data;
+        size_t size;
+      };
+      std::vector< TFixedBuffer > fixed_buffers;
+
+#ifdef COROUTINES_USE_IO_URING
+      using Coroutines::internal::io_ring;
+
+      // Sends/Recvs/Reads/Writes through the ring. Returns the bytes
+      // transferred, or -1 setting errno like the sys calls.
+      int ringOp(uint8_t opcode, TSocket sock, void* buf, size_t nbytes, int buffer_idx = -1) {
+        io_uring_sqe op;
+        memset(&op, 0, sizeof(op));
+        op.opcode = opcode;
+        int fixed_idx = io_ring.fixedFileOf(sock.s);
+        if (fixed_idx >= 0) {
+          op.fd = fixed_idx;
+          op.flags = IOSQE_FIXED_FILE;
+        }
+        else {
+          op.fd = sock.s;
+        }
+        op.addr = (uint64_t)(uintptr_t)buf;
+        op.len = (uint32_t)nbytes;
+        if (buffer_idx >= 0)
+          op.buf_index = (uint16_t)buffer_idx;
+        int rc = io_ring.execute(op);
+        if (rc < 0) {
+          errno = -rc;
+          return -1;
+        }
+        return rc;
+      }
+#endif
+
+      // The sys call is tried first, a ready socket does not need a trip
+      // through the loop. The ring only takes the ops which would block
+      int sendSome(TSocket sock, const void* buf, size_t nbytes, int buffer_idx = -1) {
+        int rc = (int)sys_send(sock.s, (const char*)buf, (int)nbytes, 0);
+#ifdef COROUTINES_USE_IO_URING
+        if (rc == -1 && sys_errno == SYS_ERR_WOULD_BLOCK && io_ring.canExecute())
+          return ringOp(buffer_idx >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_SEND, sock, (void*)buf, nbytes, buffer_idx);
+#endif
+        return rc;
+      }
+
+      int recvSome(TSocket sock, void* buf, size_t nbytes, int buffer_idx = -1) {
+        int rc = (int)sys_recv(sock.s, (char*)buf, (int)nbytes, 0);
+#ifdef COROUTINES_USE_IO_URING
+        if (rc == -1 && sys_errno == SYS_ERR_WOULD_BLOCK && io_ring.canExecute())
+          return ringOp(buffer_idx >= 0 ? IORING_OP_READ_FIXED : IORING_OP_RECV, sock, buf, nbytes, buffer_idx);
+#endif
+        return rc;
+      }
+
+      // ---------------------------------------------------------------------------
+      bool sendAll(TSocket sock, const void* src_buffer, size_t bytes_to_send, int buffer_idx) {
+        assert(bytes_to_send > 0);
+        size_t total_bytes_sent = 0;
+        while (sock) {
+          assert(bytes_to_send > total_bytes_sent);
+          auto bytes_sent = sendSome(sock, ((const char*)src_buffer) + total_bytes_sent, bytes_to_send - total_bytes_sent, buffer_idx);
+          if (bytes_sent == -1) {
+            if (sys_errno == SYS_ERR_WOULD_BLOCK) {
+              waitIO(sock, true);
+            }
+            else
+              break;
+          }
+          else {
+            //dbg("FD %d sent %ld bytes\n", fd, bytes_sent);
+            total_bytes_sent += bytes_sent;
+            if (total_bytes_sent == bytes_to_send)
+              return true;
+          }
+        }
+        return false;
+      }
+
+      // ---------------------------------------------------------------------------
+      bool recvAll(TSocket sock, void* dest_buffer, size_t bytes_to_read, int buffer_idx) {
+        assert(bytes_to_read > 0);
+        size_t total_bytes_read = 0;
+        while (sock) {
+          assert(bytes_to_read > total_bytes_read);
+          auto new_bytes_read = recvSome(sock, (char*)dest_buffer + total_bytes_read, bytes_to_read - total_bytes_read, buffer_idx);
+          if (new_bytes_read == -1) {
+            int err = sys_errno;
+            if (err == SYS_ERR_WOULD_BLOCK) {
+              waitIO(sock, false);
+            }
+            else
+              break;
+          }
+          else if (new_bytes_read == 0) {
+            break;
+          }
+          else {
+            total_bytes_read += new_bytes_read;
+            if (total_bytes_read == bytes_to_read)
+              return true;
+          }
+        }
+        return false;
+      }
+
+      // ---------------------------------------------------------------------------
+      // Scatter/gather. Returns the bytes transferred, or -1 like sendSome/recvSome
+#ifdef _WIN32
+      static const int max_iovecs_per_call = 64;
+
+      static int64_t transferSomeV(TSocket sock, TIOVec* bufs, int nbufs, bool sending) {
+        WSABUF wsa_bufs[max_iovecs_per_call];
+        DWORD n = (DWORD)std::min(nbufs, max_iovecs_per_call);
+        for (DWORD i = 0; i < n; ++i) {
+          wsa_bufs[i].buf = (char*)bufs[i].data;
+          wsa_bufs[i].len = (ULONG)bufs[i].size;
+        }
+        DWORD bytes = 0;
+        DWORD flags = 0;
+        int rc = sending
+          ? WSASend(sock.s, wsa_bufs, n, &bytes, 0, nullptr, nullptr)
+          : WSARecv(sock.s, wsa_bufs, n, &bytes, &flags, nullptr, nullptr);
+        return rc == 0 ? (int64_t)bytes : -1;
+      }
+#else
+      // TIOVec has the layout of iovec, so the array goes as is to the kernel
+      static_assert(sizeof(TIOVec) == sizeof(iovec)
+        && offsetof(TIOVec, data) == offsetof(iovec, iov_base)
+        && offsetof(TIOVec, size) == offsetof(iovec, iov_len), "TIOVec must match iovec");
+
+      static int64_t transferSomeV(TSocket sock, TIOVec* bufs, int nbufs, bool sending) {
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (iovec*)bufs;
+        msg.msg_iovlen = std::min(nbufs, IOV_MAX);
+        int64_t rc = sending ? ::sendmsg(sock.s, &msg, 0) : ::recvmsg(sock.s, &msg, 0);
+#ifdef COROUTINES_USE_IO_URING
+        // msg lives in our stack until the op completes
+        if (rc == -1 && sys_errno == SYS_ERR_WOULD_BLOCK && io_ring.canExecute())
+          return ringOp(sending ? IORING_OP_SENDMSG : IORING_OP_RECVMSG, sock, &msg, 1);
+#endif
+        return rc;
+      }
+#endif
+
+      // Keeps a copy of the bufs, advanced after each partial transfer
+      bool transferAllV(TSocket sock, const TIOVec* bufs, int nbufs, bool sending) {
+        assert(bufs && nbufs >= 0);
+        const int max_local_bufs = 16;
+        TIOVec local_bufs[max_local_bufs];
+        std::vector< TIOVec > heap_bufs;
+        TIOVec* pending = local_bufs;
+        if (nbufs > max_local_bufs) {
+          heap_bufs.assign(bufs, bufs + nbufs);
+          pending = heap_bufs.data();
+        }
+        else {
+          std::copy(bufs, bufs + nbufs, local_bufs);
+        }
+
+        int first = 0;
+        while (first < nbufs && pending[first].size == 0)
+          ++first;
+
+        while (sock && first < nbufs) {
+          auto nbytes = transferSomeV(sock, pending + first, nbufs - first, sending);
+          if (nbytes == -1) {
+            if (sys_errno == SYS_ERR_WOULD_BLOCK)
+              waitIO(sock, sending);
+            else
+              break;
+          }
+          else if (nbytes == 0 && !sending) {
+            break;
+          }
+          else {
+            // Skip the bufs completed, the last one might be partially done
+            size_t left = (size_t)nbytes;
+            while (first < nbufs && left >= pending[first].size) {
+              left -= pending[first].size;
+              ++first;
+            }
+            if (left) {
+              assert(first < nbufs);
+              pending[first].data = (char*)pending[first].data + left;
+              pending[first].size -= left;
+            }
+            while (first < nbufs && pending[first].size == 0)
+              ++first;
+          }
+        }
+        return first == nbufs;
+      }
+
     }
 
     using namespace internal;
@@ -146,7 +372,7 @@ namespace Coroutines {
           }
         }
 
-        sys_close(sock.s);
+        close(sock);
 
         // Try next candidate
         target_addr = target_addr->ai_next;
@@ -169,13 +395,14 @@ namespace Coroutines {
           int sys_err = sys_errno;
           if (sys_err == SYS_ERR_WOULD_BLOCK) {
             dbg("FD %d goes to sleep waiting for a connection\n", server);
-            wait(canRead(server));
+            waitIO(server, false);
             continue;
           }
           dbg("FD %d accept failed (%08x)\n", server, sys_err); // , strerror(sys_err) );
                                                             // Other types of errors
           return TSocket::invalid;
         }
+        checkDrained(server, false);
         dbg("FD %d has accepted new client %d\n", server, rc);
         auto new_client = rc;
         setNonBlocking( new_client );
@@ -206,6 +433,12 @@ namespace Coroutines {
         if ((s.s = sys_socket(p->ai_family, p->ai_socktype, p->ai_protocol, 0)) == -1)
           continue;
 
+#ifndef _WIN32
+        // Don't fail while the connections of a previous server are in TIME_WAIT
+        int reuse = 1;
+        setsockopt(s.s, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+#endif
+
         if (sys_bind(s.s, p->ai_addr, p->ai_addrlen) >= 0) {
           if (sys_listen(s.s, 5) >= 0)
             break;
@@ -214,10 +447,10 @@ namespace Coroutines {
         sys_close(s.s);
       }
 
+      freeaddrinfo(servinfo);
       if (!p)
-        return false;
+        return TSocket::invalid;
 
-      freeaddrinfo(servinfo);
       setNonBlocking(s);
 
       return s;
@@ -225,83 +458,111 @@ namespace Coroutines {
 
     // ---------------------------------------------------------------------------
     bool close(TSocket sock) {
+      {
+        Coroutines::internal::TSchedLock lock;
+        Coroutines::internal::io_events.forget(sock.s);
+#ifdef COROUTINES_USE_IO_URING
+        io_ring.setHot(sock.s, false);
+#endif
+      }
       sys_close(sock.s);
       return true;
     }
 
     // ---------------------------------------------------------------------------
     bool send(TSocket sock, const void* src_buffer, size_t bytes_to_send) {
-      assert(bytes_to_send > 0);
-      size_t total_bytes_sent = 0;
-      while (sock) {
-        assert(bytes_to_send > total_bytes_sent);
-        auto bytes_sent = sys_send(sock.s, ((const char*)src_buffer) + total_bytes_sent, (int)(bytes_to_send - total_bytes_sent), 0);
-        if (bytes_sent == -1) {
-          if (errno == SYS_ERR_WOULD_BLOCK) {
-            wait( canWrite(sock) );
-          }
-          else
-            break;
-        }
-        else {
-          //dbg("FD %d sent %ld bytes\n", fd, bytes_sent);
-          total_bytes_sent += bytes_sent;
-          if (total_bytes_sent == bytes_to_send)
-            return true;
-        }
-      }
-      return false;
+      return sendAll(sock, src_buffer, bytes_to_send, -1);
     }
 
     // ---------------------------------------------------------------------------
     bool recv(TSocket sock, void* dest_buffer, size_t bytes_to_read) {
-      assert(bytes_to_read > 0);
-      size_t total_bytes_read = 0;
-      while (sock) {
-        assert(bytes_to_read > total_bytes_read);
-        auto new_bytes_read = sys_recv(sock.s, (char*)dest_buffer, (int)(bytes_to_read - total_bytes_read), 0);
-        if (new_bytes_read == -1) {
-          int err = sys_errno;
-          if (err == SYS_ERR_WOULD_BLOCK) {
-            wait( canRead(sock) );
-          }
-          else
-            break;
-        }
-        else if (new_bytes_read == 0) {
-          break;
-        }
-        else {
-          total_bytes_read += new_bytes_read;
-          if (total_bytes_read == bytes_to_read)
-            return true;
-        }
-      }
-      return false;
+      return recvAll(sock, dest_buffer, bytes_to_read, -1);
+    }
+
+    // ---------------------------------------------------------------------------
+    bool sendv(TSocket sock, const TIOVec* bufs, int nbufs) {
+      return transferAllV(sock, bufs, nbufs, true);
+    }
+
+    bool recvv(TSocket sock, const TIOVec* bufs, int nbufs) {
+      return transferAllV(sock, bufs, nbufs, false);
     }
 
     // ---------------------------------------------------------------------------
     int recvUpTo(TSocket sock, void* dest_buffer, size_t bytes_to_read) {
       while (sock) {
-        auto new_bytes_read = sys_recv(sock.s, (char*)dest_buffer, (int)(bytes_to_read), 0);
+        auto new_bytes_read = recvSome(sock, dest_buffer, bytes_to_read);
         if (new_bytes_read == -1) {
           int err = sys_errno;
           if (err == SYS_ERR_WOULD_BLOCK) {
-            wait( canRead(sock) );
+            waitIO(sock, false);
           }
           else
             break;
         }
         else {
+          if ((size_t)new_bytes_read < bytes_to_read)
+            checkDrained(sock, false);
           return new_bytes_read;
         }
       }
       return -1;
     }
 
-  }
+    // ---------------------------------------------------------------------------
+    bool registerBuffers(void* const* buffers, const size_t* sizes, int nbuffers) {
+      Coroutines::internal::TSchedLock lock;
+      fixed_buffers.clear();
+      for (int i = 0; i < nbuffers; ++i)
+        fixed_buffers.push_back({ buffers[i], sizes[i] });
+#ifdef COROUTINES_USE_IO_URING
+      if (io_ring.isAvailable()) {
+        std::vector< iovec > iovs;
+        for (auto& b : fixed_buffers)
+          iovs.push_back({ b.data, b.size });
+        if (!io_ring.registerBuffers(iovs.data(), (unsigned)iovs.size())) {
+          fixed_buffers.clear();
+          return false;
+        }
+      }
+#endif
+      return true;
+    }
 
-}
+    // ---------------------------------------------------------------------------
+    // Without io_uring, the fixed buffers are just regular buffers
+    static int ringBufferIdx(int buffer_idx) {
+#ifdef COROUTINES_USE_IO_URING
+      if (io_ring.canExecute())
+        return buffer_idx;
+#endif
+      return -1;
+    }
+
+    bool sendFixed(TSocket sock, int buffer_idx, size_t offset, size_t bytes_to_send) {
+      assert(buffer_idx >= 0 && buffer_idx < (int)fixed_buffers.size());
+      auto& b = fixed_buffers[buffer_idx];
+      assert(offset + bytes_to_send <= b.size);
+      return sendAll(sock, (const char*)b.data + offset, bytes_to_send, ringBufferIdx(buffer_idx));
+    }
+
+    bool recvFixed(TSocket sock, int buffer_idx, size_t offset, size_t bytes_to_recv) {
+      assert(buffer_idx >= 0 && buffer_idx < (int)fixed_buffers.size());
+      auto& b = fixed_buffers[buffer_idx];
+      assert(offset + bytes_to_recv <= b.size);
+      return recvAll(sock, (char*)b.data + offset, bytes_to_recv, ringBufferIdx(buffer_idx));
+    }
 
+    // ---------------------------------------------------------------------------
+    bool setHot(TSocket sock, bool is_hot) {
+#ifdef COROUTINES_USE_IO_URING
+      Coroutines::internal::TSchedLock lock;
+      return io_ring.setHot(sock.s, is_hot);
+#else
+      return false;
+#endif
+    }
 
+  }
 
+}
@@ -21,6 +21,12 @@ namespace Coroutines {
 
     };
 
+    // A piece of the buffer sent/recv by sendv/recvv
+    struct TIOVec {
+      void*  data;
+      size_t size;
+    };
+
     // Will yield until the connection can be stablished
     TSocket connect(const char* addr, int port);
 
@@ -44,6 +50,22 @@ namespace Coroutines {
     // Returns number of bytes recv;
     int  recvUpTo(TSocket s, void* dest_buffer, size_t max_bytes_to_read);
 
+    // Like send/recv, but the bytes are gathered from/scattered to several
+    // buffers with a single call to the OS each time, like a header and
+    // its body. The array of bufs is not modified.
+    bool sendv(TSocket s, const TIOVec* bufs, int nbufs);
+    bool recvv(TSocket s, const TIOVec* bufs, int nbufs);
+
+    // Buffers used often by sendFixed/recvFixed. With io_uring they are pinned
+    // in the kernel just once. Replaces the previous set of buffers.
+    bool registerBuffers(void* const* buffers, const size_t* sizes, int nbuffers);
+    bool sendFixed(TSocket s, int buffer_idx, size_t offset, size_t bytes_to_send);
+    bool recvFixed(TSocket s, int buffer_idx, size_t offset, size_t bytes_to_recv);
+
+    // With io_uring, hot sockets are kept in the ring's table of fixed files,
+    // which saves the fd lookup in each send/recv. Returns false if not possible.
+    bool setHot(TSocket s, bool is_hot = true);
+
     template< typename T >
     bool operator<<(TSocket s, T& obj) {
       return recv(s, &obj, sizeof(T));
@@ -0,0 +1,525 @@
+#include "coroutines.h"
+#include "io_events.h"
+#include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+
+#ifdef COROUTINES_USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 35)
+#define COROUTINES_HAS_EPOLL_PWAIT2
+#endif
+#elif !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace Coroutines {
+
+  namespace internal {
+
+    TIOEvents io_events;
+
+    // Wake up all the coroutines waiting in the list. Returns how many
+    static int wakeUpAll(TList& waiting) {
+      int n = 0;
+      while (auto we = waiting.detachFirst< TWatchedEvent >()) {
+        wakeUp(we);
+        ++n;
+      }
+      return n;
+    }
+
+    // Longest sleep allowed by the backends, in ms
+    static const long long max_wait_ms = INT_MAX;
+
+  }
+
+#ifdef COROUTINES_USE_EPOLL
+
+  // ---------------------------------------------------
+  internal::TIOEvents::TIOEvents() {
+    epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    assert(epoll_fd >= 0);
+    interrupt_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(interrupt_fd >= 0);
+    watchForWakeUp(interrupt_fd);
+  }
+
+  internal::TIOEvents::~TIOEvents() {
+    if (interrupt_fd >= 0)
+      ::close(interrupt_fd);
+    if (epoll_fd >= 0)
+      ::close(epoll_fd);
+  }
+
+  // ---------------------------------------------------
+  // Level triggered, so they keep waking us until they are drained
+  void internal::TIOEvents::watchForWakeUp(SOCKET_ID fd) {
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    int rc = ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    assert(rc == 0);
+    (void)rc;
+  }
+
+  void internal::TIOEvents::interrupt() {
+    uint64_t one = 1;
+    auto rc = ::write(interrupt_fd, &one, sizeof(one));
+    (void)rc;
+  }
+
+  // ---------------------------------------------------
+  void internal::TIOEvents::add(TWatchedEvent* we) {
+
+    assert(we);
+    assert(we->event_type == EVT_SOCKET_IO_CAN_READ || we->event_type == EVT_SOCKET_IO_CAN_WRITE);
+
+    auto fd = we->io.fd;
+    auto e = find(fd);
+
+    // First time we see this fd, or the fd has been reused after a close
+    if (!e->registered) {
+      epoll_event ev;
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.fd = fd;
+      int rc = ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+      if (rc != 0 && errno == EEXIST)
+        rc = ::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+      // Only sockets, pipes & alike can be watched
+      assert(rc == 0);
+      e->registered = true;
+      e->ready_mask = 0;
+    }
+
+    if (we->event_type == EVT_SOCKET_IO_CAN_READ)
+      e->waiting_to_read.append(we);
+    else
+      e->waiting_to_write.append(we);
+  }
+
+  // ---------------------------------------------------
+  void internal::TIOEvents::del(TWatchedEvent* we) {
+
+    assert(we);
+    assert(we->event_type == EVT_SOCKET_IO_CAN_READ || we->event_type == EVT_SOCKET_IO_CAN_WRITE);
+
+    // The registration in epoll is kept for the next wait
+    auto fd = we->io.fd;
+    if ((size_t)fd >= entries.size())
+      return;
+    auto& e = entries[fd];
+    if (we->event_type == EVT_SOCKET_IO_CAN_READ)
+      e.waiting_to_read.detach(we);
+    else
+      e.waiting_to_write.detach(we);
+  }
+
+  // ---------------------------------------------------
+  // Edge triggered: the fd stays ready until an op finds it drained
+  bool internal::TIOEvents::isReady(const TWatchedEvent* we) const {
+    auto fd = we->io.fd;
+    if (fd < 0 || (size_t)fd >= entries.size())
+      return false;
+    int mode = (we->event_type == EVT_SOCKET_IO_CAN_READ) ? TO_READ : TO_WRITE;
+    return (entries[fd].ready_mask & mode) != 0;
+  }
+
+  bool internal::TIOEvents::clearReady(SOCKET_ID fd, eMode mode) {
+    if (fd < 0 || (size_t)fd >= entries.size())
+      return false;
+    auto& e = entries[fd];
+    if (!(e.ready_mask & mode))
+      return false;
+    e.ready_mask &= ~mode;
+    return true;
+  }
+
+  // Any edge arriving after the poll is handled by update once the sched
+  // lock is released, so it sets the readiness again
+  void internal::TIOEvents::clearReadyIfDrained(SOCKET_ID fd, eMode mode) {
+    if (fd < 0 || (size_t)fd >= entries.size() || !(entries[fd].ready_mask & mode))
+      return;
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = (mode == TO_READ) ? (POLLIN | POLLRDHUP) : POLLOUT;
+    pfd.revents = 0;
+    if (::poll(&pfd, 1, 0) == 0)
+      entries[fd].ready_mask &= ~mode;
+  }
+
+  // ---------------------------------------------------
+  void internal::TIOEvents::forget(SOCKET_ID fd) {
+    if (fd < 0 || (size_t)fd >= entries.size())
+      return;
+    auto& e = entries[fd];
+    if (e.registered)
+      ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    e.registered = false;
+    e.ready_mask = 0;
+    wakeUpAll(e.waiting_to_read);
+    wakeUpAll(e.waiting_to_write);
+  }
+
+  // ---------------------------------------------------
+  // epoll_wait only has ms resolution. When epoll_pwait2 is not available
+  // the wait is rounded down, and the last fraction of ms is spent polling
+  static int waitEpoll(int epoll_fd, epoll_event* evs, int max_evs, TTimeDelta max_wait) {
+    if (max_wait == TTimeDelta::max())
+      return ::epoll_wait(epoll_fd, evs, max_evs, -1);
+#ifdef COROUTINES_HAS_EPOLL_PWAIT2
+    static bool has_pwait2 = true;
+    if (has_pwait2) {
+      auto num_ns = std::min((long long)max_wait.count(), internal::max_wait_ms * 1000000);
+      timespec ts;
+      ts.tv_sec = (time_t)(num_ns / 1000000000);
+      ts.tv_nsec = (long)(num_ns % 1000000000);
+      int n = ::epoll_pwait2(epoll_fd, evs, max_evs, &ts, nullptr);
+      if (n >= 0 || errno != ENOSYS)
+        return n;
+      has_pwait2 = false;
+    }
+#endif
+    auto num_ms = (long long)std::chrono::duration_cast<std::chrono::milliseconds>(max_wait).count();
+    return ::epoll_wait(epoll_fd, evs, max_evs, (int)std::min(internal::max_wait_ms, num_ms));
+  }
+
+  // ---------------------------------------------------
+  // Only the fds with activity are visited
+  int internal::TIOEvents::update(TTimeDelta max_wait) {
+
+    static const int max_events_per_update = 256;
+    epoll_event evs[max_events_per_update];
+
+    int n = 0;
+    if (max_wait > TTimeDelta::zero()) {
+      TSchedUnlock unlock;
+      n = waitEpoll(epoll_fd, evs, max_events_per_update, max_wait);
+    }
+    else {
+      n = ::epoll_wait(epoll_fd, evs, max_events_per_update, 0);
+    }
+
+    int num_events = 0;
+    for (int i = 0; i < n; ++i) {
+      auto fd = evs[i].data.fd;
+      auto flags = evs[i].events;
+
+      if (fd == interrupt_fd) {
+        uint64_t count;
+        auto rc = ::read(interrupt_fd, &count, sizeof(count));
+        (void)rc;
+        continue;
+      }
+
+      // Wake up fds are handled by their owners
+      if ((size_t)fd >= entries.size() || !entries[fd].registered)
+        continue;
+      auto& e = entries[fd];
+
+      bool has_errors = (flags & (EPOLLERR | EPOLLHUP)) != 0;
+      trace(TRACE_IO_READY, THandle(), (flags & EPOLLOUT) ? EVT_SOCKET_IO_CAN_WRITE : EVT_SOCKET_IO_CAN_READ, (uint64_t)fd);
+
+      // We will not be notified again until the fd is drained, so remember
+      // it for the next waits until an op gets EWOULDBLOCK
+      if ((flags & (EPOLLIN | EPOLLRDHUP)) || has_errors) {
+        e.ready_mask |= TO_READ;
+        num_events += wakeUpAll(e.waiting_to_read);
+      }
+
+      if ((flags & EPOLLOUT) || has_errors) {
+        e.ready_mask |= TO_WRITE;
+        num_events += wakeUpAll(e.waiting_to_write);
+      }
+    }
+
+    return num_events;
+  }
+
+#else
+
+  // ---------------------------------------------------
+  internal::TIOEvents::TIOEvents() {
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    FD_ZERO(&err_fds);
+#ifndef _WIN32
+    if (::pipe(interrupt_pipe) == 0) {
+      for (auto fd : interrupt_pipe) {
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+      watchForWakeUp(interrupt_pipe[0]);
+    }
+#else
+    // Windows can't select on pipes, so interrupt sends a datagram to a udp
+    // socket connected to itself. We might be constructed before the user
+    // calls WSAStartup, which can be called several times
+    WSADATA wsa_data;
+    if (::WSAStartup(MAKEWORD(2, 2), &wsa_data) == 0) {
+      interrupt_socket = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+      sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      int addr_sz = sizeof(addr);
+      u_long non_blocking = 1;
+      if (interrupt_socket != INVALID_SOCKET
+        && ::bind(interrupt_socket, (const sockaddr*)&addr, sizeof(addr)) == 0
+        && ::getsockname(interrupt_socket, (sockaddr*)&addr, &addr_sz) == 0
+        && ::connect(interrupt_socket, (const sockaddr*)&addr, addr_sz) == 0
+        && ::ioctlsocket(interrupt_socket, FIONBIO, &non_blocking) == 0) {
+        watchForWakeUp(interrupt_socket);
+      }
+      else if (interrupt_socket != INVALID_SOCKET) {
+        ::closesocket(interrupt_socket);
+        interrupt_socket = INVALID_SOCKET;
+      }
+    }
+#endif
+  }
+
+  internal::TIOEvents::~TIOEvents() {
+#ifndef _WIN32
+    for (auto fd : interrupt_pipe) {
+      if (fd >= 0)
+        ::close(fd);
+    }
+#else
+    if (interrupt_socket != INVALID_SOCKET) {
+      ::closesocket(interrupt_socket);
+      ::WSACleanup();
+    }
+#endif
+  }
+
+  // ---------------------------------------------------
+  void internal::TIOEvents::watchForWakeUp(SOCKET_ID fd) {
+    wake_up_fds.push_back(fd);
+  }
+
+  void internal::TIOEvents::interrupt() {
+    char c = 1;
+#ifndef _WIN32
+    auto rc = ::write(interrupt_pipe[1], &c, 1);
+#else
+    auto rc = ::send(interrupt_socket, &c, 1, 0);
+#endif
+    (void)rc;
+  }
+
+  // ---------------------------------------------------
+  // select is level triggered, nothing is lost while nobody waits
+  bool internal::TIOEvents::isReady(const TWatchedEvent* we) const {
+    return false;
+  }
+
+  bool internal::TIOEvents::clearReady(SOCKET_ID fd, eMode mode) {
+    return false;
+  }
+
+  void internal::TIOEvents::clearReadyIfDrained(SOCKET_ID fd, eMode mode) {
+  }
+
+  // ---------------------------------------------------
+  void internal::TIOEvents::forget(SOCKET_ID fd) {
+    for (auto& e : entries) {
+      if (e.fd == fd) {
+        wakeUpAll(e.waiting_to_read);
+        wakeUpAll(e.waiting_to_write);
+      }
+    }
+  }
+
+  // ---------------------------------------------------
+  void internal::TIOEvents::add(TWatchedEvent* we) {
+
+    assert(we);
+    assert(we->event_type == EVT_SOCKET_IO_CAN_READ || we->event_type == EVT_SOCKET_IO_CAN_WRITE);
+
+    auto fd = we->io.fd;
+    auto mode = we->event_type == EVT_SOCKET_IO_CAN_READ ? TO_READ : TO_WRITE;
+
+    auto e = find(fd);
+
+    assert(e && e->fd == fd);
+    if (mode == TO_READ) {
+      e->mask |= TO_READ;
+      e->waiting_to_read.append(we);
+      FD_SET(fd, &rfds);
+    }
+    else {
+      e->mask |= TO_WRITE;
+      e->waiting_to_write.append(we);
+      FD_SET(fd, &wfds);
+    }
+
+    FD_SET(fd, &err_fds);
+
+    if (fd > max_fd)
+      max_fd = fd;
+  }
+
+  // ---------------------------------------------------
+  void internal::TIOEvents::del(TWatchedEvent* we) {
+
+    assert(we);
+    assert(we->event_type == EVT_SOCKET_IO_CAN_READ || we->event_type == EVT_SOCKET_IO_CAN_WRITE);
+
+    auto fd = we->io.fd;
+    auto mode = we->event_type == EVT_SOCKET_IO_CAN_READ ? TO_READ : TO_WRITE;
+
+    auto e = find(fd);
+
+    if (!e || e->mask == 0)
+      return;
+
+    assert(e && e->fd == fd);
+    e->mask &= (~mode);
+
+    if (mode == TO_READ) {
+      FD_CLR(fd, &rfds);
+      e->waiting_to_read.detach(we);
+    }
+    else {
+      FD_CLR(fd, &wfds);
+      e->waiting_to_write.detach(we);
+    }
+
+    FD_CLR(fd, &err_fds);
+
+    assert(e && e->fd == fd);
+
+    // Are we removing the largest fd we have?
+    if (e->mask == 0 && e->fd == max_fd) {
+      // Update max_fd when we remove the largest fd defined
+      max_fd = 0;
+      for (auto& e : entries) {
+        if (e.mask && e.fd > max_fd)
+          max_fd = e.fd;
+      }
+    }
+
+    SOCKET_ID new_max_fd = 0;
+    for (auto ne : entries) {
+      if (ne.mask != 0 && ne.fd > new_max_fd)
+        new_max_fd = ne.fd;
+    }
+    assert(new_max_fd == max_fd);
+
+  }
+
+  // ---------------------------------------------------
+  int internal::TIOEvents::update(TTimeDelta max_wait) {
+
+    // Amount of time to wait
+    timeval tm;
+    tm.tv_sec = 0;
+    tm.tv_usec = 0;
+    timeval* ptm = &tm;
+    if (max_wait == TTimeDelta::max()) {
+      ptm = nullptr;
+    }
+    else if (max_wait > TTimeDelta::zero()) {
+      long long num_usecs = std::chrono::duration_cast<std::chrono::microseconds>(max_wait).count();
+      num_usecs = std::min(num_usecs, max_wait_ms * 1000);
+      tm.tv_sec = (long)(num_usecs / 1000000);
+      tm.tv_usec = (long)(num_usecs % 1000000);
+    }
+
+    fd_set fds_to_read, fds_to_write;
+    fd_set fds_with_err;
+
+    memcpy(&fds_to_read, &rfds, sizeof(fd_set));
+    memcpy(&fds_to_write, &wfds, sizeof(fd_set));
+    memcpy(&fds_with_err, &err_fds, sizeof(fd_set));
+
+    SOCKET_ID nfds = max_fd;
+    for (auto fd : wake_up_fds) {
+      FD_SET(fd, &fds_to_read);
+      if (fd > nfds)
+        nfds = fd;
+    }
+
+    // Do a real wait
+    int num_events = 0;
+    int retval = 0;
+    if (ptm != &tm || tm.tv_sec || tm.tv_usec) {
+      TSchedUnlock unlock;
+#ifdef _WIN32
+      // select fails when there are no sockets to wait for, which only
+      // happens if the interrupt socket could not be created. Without it
+      // nobody can end the sleep, so an interrupt might take up to 10ms
+      if (nfds == 0) {
+        const DWORD max_sleep_ms = 10;
+        DWORD num_ms = ptm ? (DWORD)(tm.tv_sec * 1000 + tm.tv_usec / 1000) : max_sleep_ms;
+        ::Sleep(num_ms < max_sleep_ms ? num_ms : max_sleep_ms);
+        return 0;
+      }
+#endif
+      retval = ::select((int)(nfds + 1), &fds_to_read, &fds_to_write, &fds_with_err, ptm);
+    }
+    else {
+      retval = ::select((int)(nfds + 1), &fds_to_read, &fds_to_write, &fds_with_err, ptm);
+    }
+
+#ifndef _WIN32
+    if (retval > 0 && interrupt_pipe[0] >= 0 && FD_ISSET(interrupt_pipe[0], &fds_to_read)) {
+      char buf[64];
+      while (::read(interrupt_pipe[0], buf, sizeof(buf)) > 0);
+    }
+#else
+    if (retval > 0 && interrupt_socket != INVALID_SOCKET && FD_ISSET(interrupt_socket, &fds_to_read)) {
+      char buf[64];
+      while (::recv(interrupt_socket, buf, sizeof(buf), 0) > 0);
+    }
+#endif
+
+    if (retval > 0) {
+
+      for (auto& e : entries) {
+
+        if (!e.mask)
+          continue;
+
+        if (FD_ISSET(e.fd, &fds_with_err))
+          printf("Socket %d has errors\n", (int)e.fd);
+
+        // we were waiting a read op, and we can read now...
+        if (((e.mask & TO_READ) && FD_ISSET(e.fd, &fds_to_read)) || FD_ISSET(e.fd, &fds_with_err)) {
+          auto we = e.waiting_to_read.detachFirst< TWatchedEvent >();
+          if (we) {
+            trace(TRACE_IO_READY, THandle(), EVT_SOCKET_IO_CAN_READ, (uint64_t)e.fd);
+            assert(we->io.fd == e.fd);
+            assert(we->event_type == EVT_SOCKET_IO_CAN_READ);
+            wakeUp(we);
+            ++num_events;
+          }
+        }
+
+        if (((e.mask & TO_WRITE) && FD_ISSET(e.fd, &fds_to_write)) || FD_ISSET(e.fd, &fds_with_err)) {
+          auto we = e.waiting_to_write.detachFirst< TWatchedEvent >();
+          if (we) {
+            trace(TRACE_IO_READY, THandle(), EVT_SOCKET_IO_CAN_WRITE, (uint64_t)e.fd);
+            assert(we->io.fd == e.fd);
+            assert(we->event_type == EVT_SOCKET_IO_CAN_WRITE);
+            wakeUp(we);
+            ++num_events;
+          }
+        }
+
+      }
+    }
+    return num_events;
+  }
+
+
+
+#endif
+
+}
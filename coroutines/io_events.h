@@ -11,7 +11,7 @@
 #include <winsock2.h>             // fd_set Family
 #include <ws2tcpip.h>
 typedef SOCKET           SOCKET_ID;
-  
+
 #else     // -----------------------------------------------------------
 
 #include <sys/types.h>
@@ -22,7 +22,13 @@ typedef int              SOCKET_ID;
 
 #endif    // -----------------------------------------------------------
 
+// Linux uses epoll unless COROUTINES_USE_SELECT is defined
+#if defined(__linux__) && !defined(COROUTINES_USE_SELECT)
+#define COROUTINES_USE_EPOLL
+#endif
+
 #include "list.h"
+#include "timeline.h"
 
 namespace Coroutines {
 
@@ -32,6 +38,33 @@ namespace Coroutines {
 
     struct TIOEvents {
 
+#ifdef COROUTINES_USE_EPOLL
+
+      // Each fd is registered once for reading & writing in edge triggered
+      // mode, and stays registered until the socket is closed.
+      struct TEntry {
+        bool            registered = false;
+        int             ready_mask = 0;     // Edges recv and not yet drained by an op
+        TList           waiting_to_read;
+        TList           waiting_to_write;
+      };
+
+      // Indexed by fd
+      typedef std::vector< TEntry > VDescriptors;
+      VDescriptors entries;
+      int          epoll_fd = -1;
+
+      int          interrupt_fd = -1;   // eventfd used by interrupt
+
+      TEntry* find(SOCKET_ID fd) {
+        assert(fd >= 0);
+        if ((size_t)fd >= entries.size())
+          entries.resize(fd + 1);
+        return &entries[fd];
+      }
+
+#else
+
       struct TEntry {
         SOCKET_ID       fd;
         int             mask = 0;
@@ -47,6 +80,13 @@ namespace Coroutines {
       fd_set       wfds;
       fd_set       err_fds;
 
+      std::vector< SOCKET_ID > wake_up_fds;
+#ifndef _WIN32
+      int          interrupt_pipe[2] = { -1, -1 };
+#else
+      SOCKET       interrupt_socket = INVALID_SOCKET;   // udp, connected to itself
+#endif
+
       TEntry* find(SOCKET_ID fd) {
         for (auto& e : entries) {
           if (e.fd == fd)
@@ -58,13 +98,12 @@ namespace Coroutines {
         return &entries.back();
       }
 
+#endif
+
     public:
 
-      TIOEvents() {
-        FD_ZERO(&rfds);
-        FD_ZERO(&wfds);
-        FD_ZERO(&err_fds);
-      }
+      TIOEvents();
+      ~TIOEvents();
 
       enum eMode {
         TO_READ = 1,
@@ -73,8 +112,35 @@ namespace Coroutines {
 
       void add(TWatchedEvent* we);
       void del(TWatchedEvent* we);
-      int update();
+
+      // Wakes up the coroutines with io activity. If max_wait > 0 and there
+      // is nothing yet, sleeps up to max_wait with the sched lock released
+      int update(TTimeDelta max_wait = TTimeDelta::zero());
+
+      // Ends the sleep of update. Can be called from any thread
+      void interrupt();
+
+      // Activity in the fd will also end the sleep of update (used by the io_uring)
+      void watchForWakeUp(SOCKET_ID fd);
+
+      // True if the fd became ready and no op has found it drained since.
+      // Does not change the state, it can be checked any number of times
+      bool isReady(const TWatchedEvent* we) const;
+
+      // An op on the fd returned EWOULDBLOCK, so the readiness remembered is
+      // stale. Returns true if there was some, and the op should be retried
+      // before waiting, as the edge might have arrived after the op failed
+      bool clearReady(SOCKET_ID fd, eMode mode);
+
+      // An op succeeded but might have drained the fd (an accept, a short
+      // recv). Clears the readiness only if the fd has nothing else now
+      void clearReadyIfDrained(SOCKET_ID fd, eMode mode);
+
+      // The socket is about to be closed. Wakes up anyone still waiting on it.
+      void forget(SOCKET_ID fd);
     };
+
+    extern TIOEvents io_events;
   }
 
 }
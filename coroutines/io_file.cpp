@@ -1,5 +1,6 @@
 #include "coroutines.h"
 #include "io_file.h"
+#include "io_ring.h"
 
 extern void dbg(const char *fmt, ...);
 
@@ -52,7 +53,7 @@ namespace Coroutines {
       TFile::TFile(const char* filename, eMode new_mode ) {
         mode = new_mode;
         int flags = ( new_mode == FOR_READING ) ? O_RDONLY : ( O_RDWR | O_CREAT | O_TRUNC );
-        handle = ::open( filename, flags );
+        handle = ::open( filename, flags, 0644 );
       }
 
       TFile::~TFile() {
@@ -70,8 +71,38 @@ namespace Coroutines {
         return (rc == 0) ? buf.st_size : 0;
       }
 
+#ifdef COROUTINES_USE_IO_URING
+      // Reads or writes all the bytes in chunks using the ring.
+      static bool ringFileOp( int handle, uint8_t opcode, void* data, size_t nbytes ) {
+        using Coroutines::internal::io_ring;
+        const size_t max_chunk = 1 << 30;
+        size_t bytes_processed = 0;
+        while( bytes_processed != nbytes ) {
+          size_t chunk = nbytes - bytes_processed;
+          if( chunk > max_chunk )
+            chunk = max_chunk;
+          io_uring_sqe op;
+          memset( &op, 0, sizeof( op ) );
+          op.opcode = opcode;
+          op.fd = handle;
+          op.addr = (uint64_t)(uintptr_t)( (char*)data + bytes_processed );
+          op.len = (uint32_t)chunk;
+          op.off = bytes_processed;
+          int rc = io_ring.execute( op );
+          if( rc <= 0 )
+            return false;
+          bytes_processed += rc;
+        }
+        return true;
+      }
+#endif
+
       bool TFile::asyncRead( void* data, size_t nbytes ) {
         assert( mode == FOR_READING && isValid() );
+#ifdef COROUTINES_USE_IO_URING
+        if( Coroutines::internal::io_ring.canExecute() )
+          return ringFileOp( handle, IORING_OP_READ, data, nbytes );
+#endif
         auto mapped = mmap( 0, nbytes, PROT_READ, MAP_PRIVATE, handle, 0 );
         if( mapped == MAP_FAILED )
           return false;
@@ -103,6 +134,10 @@ namespace Coroutines {
 
       bool TFile::asyncWrite( const void* data, size_t nbytes ) {
         assert( mode == FOR_WRITING && isValid() );
+#ifdef COROUTINES_USE_IO_URING
+        if( Coroutines::internal::io_ring.canExecute() )
+          return ringFileOp( handle, IORING_OP_WRITE, (void*)data, nbytes );
+#endif
         lseek( handle, nbytes-1, SEEK_SET );
         if( write( handle, "\0", 1 ) != 1 )
           return false;
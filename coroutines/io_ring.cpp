@@ -0,0 +1,355 @@
+#include "coroutines.h"
+#include "io_ring.h"
+
+#ifdef COROUTINES_USE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+
+namespace Coroutines {
+
+  namespace internal {
+
+    TIORing io_ring;
+
+    void kickPoller();
+
+    // user_data of the cancel requests, their cqe's are discarded
+    static const uint64_t cancel_user_data = ~0ULL;
+
+    static int sys_io_uring_setup(unsigned entries, io_uring_params* p) {
+      return (int)::syscall(__NR_io_uring_setup, entries, p);
+    }
+
+    static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+      return (int)::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+    }
+
+    static int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args) {
+      return (int)::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+    }
+
+    // ---------------------------------------------------------
+    TIORing::TIORing() {
+      // These are the ops used by Net & IO. Without them we fall back to epoll/select
+      static const uint8_t required_ops[] = {
+        IORING_OP_SEND, IORING_OP_RECV, IORING_OP_READ, IORING_OP_WRITE
+      , IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED, IORING_OP_ASYNC_CANCEL
+      , IORING_OP_SENDMSG, IORING_OP_RECVMSG
+      };
+      if (!setup(256))
+        return;
+      if (!supportsOps(required_ops, (int)sizeof(required_ops))) {
+        teardown();
+        return;
+      }
+
+      // A sparse table of fixed files, filled by setHot
+      std::vector< int > no_files(max_fixed_files, -1);
+      has_fixed_files = sys_io_uring_register(ring_fd, IORING_REGISTER_FILES, no_files.data(), max_fixed_files) == 0;
+      if (has_fixed_files) {
+        for (uint32_t i = max_fixed_files; i > 0; --i)
+          free_fixed.push_back(i - 1);
+      }
+    }
+
+    TIORing::~TIORing() {
+      teardown();
+    }
+
+    // ---------------------------------------------------------
+    bool TIORing::setup(unsigned entries) {
+      io_uring_params p;
+      memset(&p, 0, sizeof(p));
+      int fd = sys_io_uring_setup(entries, &p);
+      if (fd < 0)
+        return false;
+
+      sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+      bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+      if (single_mmap && cq_size > sq_size)
+        sq_size = cq_size;
+
+      sq_ptr = ::mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+      if (sq_ptr == MAP_FAILED) {
+        ::close(fd);
+        return false;
+      }
+
+      if (single_mmap) {
+        cq_ptr = sq_ptr;
+      }
+      else {
+        cq_ptr = ::mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+          ::munmap(sq_ptr, sq_size);
+          ::close(fd);
+          return false;
+        }
+      }
+
+      sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+      void* sqes_ptr = ::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+      if (sqes_ptr == MAP_FAILED) {
+        if (cq_ptr != sq_ptr)
+          ::munmap(cq_ptr, cq_size);
+        ::munmap(sq_ptr, sq_size);
+        ::close(fd);
+        return false;
+      }
+
+      auto sq = (char*)sq_ptr;
+      sq_head = (unsigned*)(sq + p.sq_off.head);
+      sq_tail = (unsigned*)(sq + p.sq_off.tail);
+      sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+      sq_array = (unsigned*)(sq + p.sq_off.array);
+      sqes = (io_uring_sqe*)sqes_ptr;
+
+      auto cq = (char*)cq_ptr;
+      cq_head = (unsigned*)(cq + p.cq_off.head);
+      cq_tail = (unsigned*)(cq + p.cq_off.tail);
+      cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+      cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+
+      num_entries = p.sq_entries;
+      ring_fd = fd;
+      return true;
+    }
+
+    void TIORing::teardown() {
+      if (ring_fd < 0)
+        return;
+      ::munmap(sqes, sqes_size);
+      if (cq_ptr != sq_ptr)
+        ::munmap(cq_ptr, cq_size);
+      ::munmap(sq_ptr, sq_size);
+      ::close(ring_fd);
+      ring_fd = -1;
+    }
+
+    // ---------------------------------------------------------
+    bool TIORing::supportsOps(const uint8_t* ops, int nops) {
+      const int max_ops = 256;
+      size_t probe_size = sizeof(io_uring_probe) + max_ops * sizeof(io_uring_probe_op);
+      auto probe = (io_uring_probe*)calloc(1, probe_size);
+      bool all_supported = false;
+      if (sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, max_ops) == 0) {
+        all_supported = true;
+        for (int i = 0; i < nops; ++i) {
+          auto op = ops[i];
+          if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+            all_supported = false;
+        }
+      }
+      free(probe);
+      return all_supported;
+    }
+
+    // ---------------------------------------------------------
+    io_uring_sqe* TIORing::getSqe() {
+      unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+      unsigned tail = *sq_tail;
+      if (tail - head >= num_entries) {
+        // Full. Let the kernel consume what we have so far
+        submit();
+        head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= num_entries)
+          return nullptr;
+      }
+      unsigned idx = tail & *sq_mask;
+      sq_array[idx] = idx;
+      __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+      ++sq_pending;
+      return &sqes[idx];
+    }
+
+    int TIORing::submit() {
+      if (!sq_pending)
+        return 0;
+      int rc = sys_io_uring_enter(ring_fd, sq_pending, 0, 0);
+      if (rc > 0)
+        sq_pending -= rc;
+      return rc;
+    }
+
+    // ---------------------------------------------------------
+    int TIORing::execute(const io_uring_sqe& op) {
+      assert(isAvailable());
+      TSchedLock lock;
+
+      uint32_t slot_idx;
+      if (free_slots.empty()) {
+        slot_idx = (uint32_t)slots.size();
+        slots.resize(slots.size() + 1);
+      }
+      else {
+        slot_idx = free_slots.back();
+        free_slots.pop_back();
+      }
+
+      auto sqe = getSqe();
+      if (!sqe) {
+        free_slots.push_back(slot_idx);
+        return -EBUSY;
+      }
+      *sqe = op;
+      sqe->user_data = slot_idx;
+
+      TWatchedEvent we;
+      we.event_type = EVT_IO_COMPLETED;
+      we.owner = current();
+      we.ring.slot = slot_idx;
+      we.ring.result = 0;
+
+      auto& slot = slots[slot_idx];
+      slot.we = &we;
+      slot.in_use = true;
+
+      // The op will be submitted with the others in the next update, which
+      // might be sleeping right now
+      kickPoller();
+      wait(&we, 1);
+      assert(we.ring.slot == TWatchedEvent::ring_completed);
+      return we.ring.result;
+    }
+
+    // ---------------------------------------------------------
+    bool TIORing::queueCancel(uint32_t slot_idx) {
+      auto sqe = getSqe();
+      if (!sqe)
+        return false;
+      memset(sqe, 0, sizeof(*sqe));
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->addr = slot_idx;
+      sqe->user_data = cancel_user_data;
+      return true;
+    }
+
+    bool TIORing::cancel(TWatchedEvent* we, fcontext_stack_t& stack, eStackSize stack_size) {
+      assert(we && we->event_type == EVT_IO_COMPLETED);
+      if (we->ring.slot == TWatchedEvent::ring_completed)
+        return false;
+
+      // The slot stays in use until the kernel returns the cqe
+      uint32_t slot_idx = we->ring.slot;
+      auto& slot = slots[slot_idx];
+      slot.we = nullptr;
+      we->ring.slot = TWatchedEvent::ring_completed;
+      slot.stack = stack;
+      slot.stack_size = stack_size;
+      stack = fcontext_stack_t{ nullptr, 0 };
+
+      // Submitted with the others in the next update. We don't wait for it
+      if (!queueCancel(slot_idx))
+        slots_to_cancel.push_back(slot_idx);
+      kickPoller();
+      return true;
+    }
+
+    // ---------------------------------------------------------
+    int TIORing::update() {
+      if (!isAvailable())
+        return 0;
+      while (!slots_to_cancel.empty() && queueCancel(slots_to_cancel.back()))
+        slots_to_cancel.pop_back();
+      submit();
+      return reap();
+    }
+
+    int TIORing::reap() {
+      int num_events = 0;
+      unsigned head = *cq_head;
+      unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+      while (head != tail) {
+        auto& cqe = cqes[head & *cq_mask];
+        ++head;
+        if (cqe.user_data == cancel_user_data)
+          continue;
+
+        uint32_t slot_idx = (uint32_t)cqe.user_data;
+        assert(slot_idx < slots.size());
+        auto& slot = slots[slot_idx];
+        assert(slot.in_use);
+        auto we = slot.we;
+        slot.we = nullptr;
+        slot.in_use = false;
+        free_slots.push_back(slot_idx);
+
+        // The waiter might have gone before the op finished. The kernel is
+        // done with its stack now
+        if (!we) {
+          stack_pools.release(slot.stack, slot.stack_size);
+          continue;
+        }
+        we->ring.result = cqe.res;
+        we->ring.slot = TWatchedEvent::ring_completed;
+        trace(TRACE_IO_READY, THandle(), EVT_IO_COMPLETED, (uint64_t)(int64_t)cqe.res);
+        wakeUp(we);
+        ++num_events;
+      }
+      __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+      return num_events;
+    }
+
+    // ---------------------------------------------------------
+    bool TIORing::setHot(int fd, bool is_hot) {
+      if (!has_fixed_files || fd < 0)
+        return false;
+
+      int current_idx = fixedFileOf(fd);
+      if (is_hot == (current_idx >= 0))
+        return true;
+
+      int new_value = -1;
+      uint32_t idx = 0;
+      if (is_hot) {
+        if (free_fixed.empty())
+          return false;
+        idx = free_fixed.back();
+        new_value = fd;
+      }
+      else {
+        idx = (uint32_t)current_idx;
+      }
+
+      io_uring_files_update upd;
+      memset(&upd, 0, sizeof(upd));
+      upd.offset = idx;
+      upd.fds = (uint64_t)(uintptr_t)&new_value;
+      if (sys_io_uring_register(ring_fd, IORING_REGISTER_FILES_UPDATE, &upd, 1) != 1)
+        return false;
+
+      if ((size_t)fd >= fixed_by_fd.size())
+        fixed_by_fd.resize(fd + 1, -1);
+      if (is_hot) {
+        free_fixed.pop_back();
+        fixed_by_fd[fd] = (int)idx;
+      }
+      else {
+        free_fixed.push_back(idx);
+        fixed_by_fd[fd] = -1;
+      }
+      return true;
+    }
+
+    // ---------------------------------------------------------
+    bool TIORing::registerBuffers(const iovec* iovs, unsigned nbuffers) {
+      if (!isAvailable())
+        return false;
+      // Fails with ENXIO if there were no buffers registered
+      sys_io_uring_register(ring_fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+      if (!nbuffers)
+        return true;
+      return sys_io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, iovs, nbuffers) == 0;
+    }
+
+  }
+
+}
+
+#endif
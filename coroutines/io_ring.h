@@ -0,0 +1,127 @@
+#ifndef INC_COROUTINES_IO_RING_H_
+#define INC_COROUTINES_IO_RING_H_
+
+// Linux uses io_uring when the kernel supports it, unless COROUTINES_NO_IO_URING is defined
+#if defined(__linux__) && !defined(COROUTINES_NO_IO_URING)
+#define COROUTINES_USE_IO_URING
+#endif
+
+#ifdef COROUTINES_USE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <vector>
+#include "stacks.h"
+
+namespace Coroutines {
+
+  struct TWatchedEvent;
+
+  namespace internal {
+
+    // Implemented in coroutines.cpp
+    bool runsInOwnStack();
+
+    // -------------------------------------------------------------
+    // Completion based io. The coroutine queues a sqe and sleeps in a
+    // EVT_IO_COMPLETED event until the cqe arrives. Submissions and
+    // completions are batched in a single io_uring_enter per loop.
+    // All methods must be called with the sched lock taken.
+    class TIORing {
+
+      // Each operation in flight owns a slot. The slot is the user_data of the sqe
+      struct TSlot {
+        TWatchedEvent*   we = nullptr;    // nullptr if the waiter has gone
+        bool             in_use = false;
+        fcontext_stack_t stack = { nullptr, 0 };   // Of the waiter which has gone
+        eStackSize       stack_size = STACK_DEFAULT;
+      };
+
+      int                     ring_fd = -1;
+      unsigned                num_entries = 0;
+
+      // Submission queue
+      unsigned*               sq_head = nullptr;
+      unsigned*               sq_tail = nullptr;
+      unsigned*               sq_mask = nullptr;
+      unsigned*               sq_array = nullptr;
+      io_uring_sqe*           sqes = nullptr;
+      unsigned                sq_pending = 0;      // Queued but not yet submitted
+
+      // Completion queue
+      unsigned*               cq_head = nullptr;
+      unsigned*               cq_tail = nullptr;
+      unsigned*               cq_mask = nullptr;
+      io_uring_cqe*           cqes = nullptr;
+
+      void*                   sq_ptr = nullptr;
+      size_t                  sq_size = 0;
+      void*                   cq_ptr = nullptr;
+      size_t                  cq_size = 0;
+      size_t                  sqes_size = 0;
+
+      std::vector< TSlot >    slots;
+      std::vector< uint32_t > free_slots;
+      std::vector< uint32_t > slots_to_cancel;    // The sq was full when they were cancelled
+
+      // Fixed files
+      static const unsigned   max_fixed_files = 1024;
+      bool                    has_fixed_files = false;
+      std::vector< int >      fixed_by_fd;        // Fixed file idx for each fd, or -1
+      std::vector< uint32_t > free_fixed;
+
+      bool setup(unsigned entries);
+      void teardown();
+      bool supportsOps(const uint8_t* ops, int nops);
+      io_uring_sqe* getSqe();
+      bool queueCancel(uint32_t slot_idx);
+      int  submit();
+      int  reap();
+
+    public:
+
+      TIORing();
+      ~TIORing();
+
+      bool isAvailable() const { return ring_fd >= 0; }
+
+      // The kernel writes the results while we sleep. The main thread can't
+      // sleep, and the stack of the coroutines in STACK_SHARED mode is not
+      // always in place
+      bool canExecute() const { return isAvailable() && runsInOwnStack(); }
+
+      // Readable when there are completions to reap
+      int  fd() const { return ring_fd; }
+
+      // Queues the op and sleeps until it completes. Returns the cqe res (-errno on failure)
+      int  execute(const io_uring_sqe& op);
+
+      // Submits the queued ops and wakes up the owners of the completed ones
+      int  update();
+
+      // The waiter of the op is leaving before the completion arrived. The
+      // kernel might still write in the buffers of the op, which live in the
+      // stack of the waiter, so the slot keeps the stack and releases it to
+      // the pool when the cqe arrives. Returns false, and leaves the stack
+      // alone, if the op had already completed
+      bool cancel(TWatchedEvent* we, fcontext_stack_t& stack, eStackSize stack_size);
+
+      // Hot fds are kept in the fixed files table of the ring
+      bool setHot(int fd, bool is_hot);
+      int  fixedFileOf(int fd) const {
+        return (fd >= 0 && (size_t)fd < fixed_by_fd.size()) ? fixed_by_fd[fd] : -1;
+      }
+
+      // Pins the buffers for READ_FIXED/WRITE_FIXED ops. Replaces the previous set
+      bool registerBuffers(const iovec* iovs, unsigned nbuffers);
+    };
+
+    extern TIORing io_ring;
+
+  }
+
+}
+
+#endif
+
+#endif
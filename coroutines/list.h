@@ -37,6 +37,9 @@ namespace Coroutines {
         item->next->prev = item->prev;
       else if (last == item)
         last = item->prev;
+      // So it can be appended again to this or other list
+      item->prev = nullptr;
+      item->next = nullptr;
     }
     template< class T >
     T* detachFirst() {
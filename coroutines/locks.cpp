@@ -0,0 +1,144 @@
+#include "coroutines.h"
+
+namespace Coroutines {
+
+  namespace internal {
+
+    // -------------------------------------------------------------
+    // Hands it to the first waiters, in order, while they can take it
+    void TSyncObject::grantWaiters() {
+      while (auto we = static_cast<TWatchedEvent*>(waiters.first)) {
+        if (!take(we->sync.mode))
+          break;
+        waiters.detach(we);
+        we->sync.granted = true;
+        wakeUp(we);
+      }
+    }
+
+    bool TSyncObject::acquire(int mode, TTimeDelta timeout) {
+      TWatchedEvent wes[2] = { TWatchedEvent(this, mode), TWatchedEvent() };
+      int n = 1;
+      if (timeout != no_timeout)
+        wes[n++] = TWatchedEvent(timeout);
+      return wait(wes, n) == 0;
+    }
+
+    void TSyncObject::release(int mode) {
+      TSchedLock lock;
+      giveBack(mode);
+      grantWaiters();
+    }
+
+  }
+
+  // -------------------------------------------------------------
+  bool TMutex::take(int) {
+    if (locked)
+      return false;
+    locked = true;
+    return true;
+  }
+
+  void TMutex::giveBack(int) {
+    assert(locked);
+    locked = false;
+  }
+
+  bool TMutex::tryLock() {
+    internal::TSchedLock lock;
+    return tryAcquire(0);
+  }
+
+  // -------------------------------------------------------------
+  bool TSemaphore::take(int) {
+    if (count <= 0)
+      return false;
+    --count;
+    return true;
+  }
+
+  void TSemaphore::giveBack(int) {
+    ++count;
+  }
+
+  bool TSemaphore::tryAcquire() {
+    internal::TSchedLock lock;
+    return TSyncObject::tryAcquire(0);
+  }
+
+  // -------------------------------------------------------------
+  bool TRWLock::take(int mode) {
+    if (has_writer)
+      return false;
+    if (mode == SHARED) {
+      ++num_readers;
+      return true;
+    }
+    if (num_readers)
+      return false;
+    has_writer = true;
+    return true;
+  }
+
+  void TRWLock::giveBack(int mode) {
+    if (mode == SHARED) {
+      assert(num_readers > 0);
+      --num_readers;
+    }
+    else {
+      assert(has_writer);
+      has_writer = false;
+    }
+  }
+
+  // -------------------------------------------------------------
+  bool TCondVar::take(int) {
+    if (!notifications)
+      return false;
+    --notifications;
+    return true;
+  }
+
+  // A waiter leaving for other reason after being notified. release hands
+  // the notification to the next waiter, and if there is none it's dropped
+  void TCondVar::giveBack(int) {
+    if (!waiters.empty())
+      ++notifications;
+  }
+
+  bool TCondVar::wait(TMutex& mutex, TTimeDelta timeout) {
+    internal::TSchedLock lock;
+    assert(mutex.isLocked());
+    // With the sched lock taken, nobody can notify us between the unlock
+    // and the registration in the waiters
+    mutex.unlock();
+    bool notified = acquire(0, timeout);
+    mutex.lock();
+    return notified;
+  }
+
+  // Notifications are only stored when someone is waiting for them
+  void TCondVar::notifyOne() {
+    internal::TSchedLock lock;
+    if (waiters.empty())
+      return;
+    ++notifications;
+    grantWaiters();
+  }
+
+  void TCondVar::notifyAll() {
+    internal::TSchedLock lock;
+    while (!waiters.empty()) {
+      ++notifications;
+      grantWaiters();
+    }
+  }
+
+  // -------------------------------------------------------------
+  TWatchedEvent canLock(TMutex& mutex) { return TWatchedEvent(&mutex, 0); }
+  TWatchedEvent canLock(TRWLock& rwlock) { return TWatchedEvent(&rwlock, TRWLock::EXCLUSIVE); }
+  TWatchedEvent canLockShared(TRWLock& rwlock) { return TWatchedEvent(&rwlock, TRWLock::SHARED); }
+  TWatchedEvent canAcquire(TSemaphore& semaphore) { return TWatchedEvent(&semaphore, 0); }
+
+}
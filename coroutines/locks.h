@@ -0,0 +1,114 @@
+#ifndef INC_COROUTINES_LOCKS_H_
+#define INC_COROUTINES_LOCKS_H_
+
+namespace Coroutines {
+
+  // -------------------------------------------------------------
+  namespace internal {
+
+    // Something the coroutines acquire in fifo order. When it's released,
+    // it's handed directly to the first waiters which can take it, so the
+    // ones behind them keep sleeping.
+    // The protected methods must be called with the sched lock taken
+    class TSyncObject {
+    protected:
+      TList waiters;
+
+      // Takes it if possible right now, ignoring the waiters
+      virtual bool take(int mode) = 0;
+
+      // Gives back what take got
+      virtual void giveBack(int mode) = 0;
+
+      void grantWaiters();
+
+      // Sleeps until acquired or the timeout expires
+      bool acquire(int mode, TTimeDelta timeout);
+
+      TSyncObject() = default;
+
+    public:
+
+      TSyncObject(const TSyncObject&) = delete;
+      TSyncObject& operator=(const TSyncObject&) = delete;
+      virtual ~TSyncObject() { assert(waiters.empty()); }
+
+      // Used by wait. Newcomers can't overtake the ones already waiting
+      bool tryAcquire(int mode) { return waiters.empty() && take(mode); }
+      void release(int mode);
+      void addWaiter(TWatchedEvent* we) { waiters.append(we); }
+      void removeWaiter(TWatchedEvent* we) { waiters.detach(we); }
+    };
+
+  }
+
+  // -------------------------------------------------------------
+  class TMutex : public internal::TSyncObject {
+    bool locked = false;
+    bool take(int mode) override;
+    void giveBack(int mode) override;
+  public:
+    void lock() { acquire(0, no_timeout); }
+    bool lock(TTimeDelta timeout) { return acquire(0, timeout); }
+    bool tryLock();
+    void unlock() { release(0); }
+    bool isLocked() const { return locked; }
+  };
+
+  // -------------------------------------------------------------
+  class TSemaphore : public internal::TSyncObject {
+    int  count = 0;
+    bool take(int mode) override;
+    void giveBack(int mode) override;
+  public:
+    TSemaphore(int initial_count = 0) : count(initial_count) { }
+    void acquire() { TSyncObject::acquire(0, no_timeout); }
+    bool acquire(TTimeDelta timeout) { return TSyncObject::acquire(0, timeout); }
+    bool tryAcquire();
+    void release() { TSyncObject::release(0); }
+  };
+
+  // -------------------------------------------------------------
+  // Many readers or one writer. A writer waiting stops the readers arriving
+  // after it, so writers don't starve
+  class TRWLock : public internal::TSyncObject {
+    int  num_readers = 0;
+    bool has_writer = false;
+    bool take(int mode) override;
+    void giveBack(int mode) override;
+  public:
+    enum eMode { SHARED = 0, EXCLUSIVE = 1 };
+    void lockShared() { acquire(SHARED, no_timeout); }
+    bool lockShared(TTimeDelta timeout) { return acquire(SHARED, timeout); }
+    void unlockShared() { release(SHARED); }
+    void lock() { acquire(EXCLUSIVE, no_timeout); }
+    bool lock(TTimeDelta timeout) { return acquire(EXCLUSIVE, timeout); }
+    void unlock() { release(EXCLUSIVE); }
+  };
+
+  // -------------------------------------------------------------
+  // Each notification wakes up the first waiter. A waiter which has gone
+  // before getting it passes it to the next one
+  class TCondVar : public internal::TSyncObject {
+    int  notifications = 0;
+    bool take(int mode) override;
+    void giveBack(int mode) override;
+  public:
+    // Unlocks the mutex while sleeping, and locks it again before returning.
+    // Returns false if the timeout expires before being notified
+    bool wait(TMutex& mutex, TTimeDelta timeout = no_timeout);
+    void notifyOne();
+    void notifyAll();
+  };
+
+  // -------------------------------------------------------------
+  // To combine the acquisitions with other events in wait. When wait
+  // returns the index of the event, the object has been acquired
+  TWatchedEvent canLock(TMutex& mutex);
+  TWatchedEvent canLock(TRWLock& rwlock);
+  TWatchedEvent canLockShared(TRWLock& rwlock);
+  TWatchedEvent canAcquire(TSemaphore& semaphore);
+
+}
+
+#endif
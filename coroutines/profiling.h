@@ -0,0 +1,43 @@
+#ifndef INC_COROUTINES_PROFILING_H_
+#define INC_COROUTINES_PROFILING_H_
+
+#include <vector>
+
+namespace Coroutines {
+
+  // -------------------------------------------------------------
+  // Per coroutine accounting. The library only measures when it's compiled
+  // with COROUTINES_PROFILING defined, otherwise the scheduler has no extra
+  // cost and the queries return nothing.
+  struct TCoroStats {
+    THandle    h;
+    TTimeDelta running_time = TTimeDelta::zero();  // From being resumed to switching out
+    uint64_t   num_switches = 0;                   // Times it has been resumed
+
+    // Sleeping in wait, by the type of the event which woke it up
+    TTimeDelta waiting_time[EVT_INVALID] = {};
+
+    TTimeDelta totalWaitingTime() const {
+      TTimeDelta total = TTimeDelta::zero();
+      for (auto t : waiting_time)
+        total += t;
+      return total;
+    }
+  };
+
+  enum eCoroMetric {
+    METRIC_RUNNING_TIME
+  , METRIC_NUM_SWITCHES
+  , METRIC_WAITING_TIME
+  };
+
+  // The n coroutines alive with the highest value of the metric. The waiting
+  // time can be restricted to one event type, EVT_INVALID means all of them
+  std::vector< TCoroStats > topCoroutines(eCoroMetric metric, size_t n, eEventType evt = EVT_INVALID);
+
+  // False if the handle is no longer valid or the stats are not compiled in
+  bool getCoroStats(THandle h, TCoroStats& stats);
+
+}
+
+#endif
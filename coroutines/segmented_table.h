@@ -0,0 +1,64 @@
+#ifndef INC_COROUTINES_SEGMENTED_TABLE_H_
+#define INC_COROUTINES_SEGMENTED_TABLE_H_
+
+#include <atomic>
+#include <cassert>
+#include <cinttypes>
+#include <memory>
+#include <vector>
+
+namespace Coroutines {
+
+  namespace internal {
+
+    // -------------------------------------------------------------
+    // Table of objects stored in segments of 2^segment_bits. Growing just
+    // adds a segment, so the objects never move and the pointers to them
+    // stay valid. The segments live as long as the process.
+    // Only one thread can grow it at a time, but others can read the
+    // entries below size() meanwhile: the directory of segments is
+    // replaced by a bigger copy instead of being reallocated in place.
+    template< typename T, int segment_bits = 10 >
+    class TSegmentedTable {
+      static const uint32_t segment_size = 1u << segment_bits;
+
+      std::vector< std::unique_ptr< T*[] > > directories;   // The last one is the current
+      std::atomic< T** >    segments{ nullptr };
+      uint32_t              num_segments = 0;
+      uint32_t              max_segments = 0;
+      std::atomic<uint32_t> count{ 0 };
+
+    public:
+
+      uint32_t size() const { return count.load(std::memory_order_acquire); }
+
+      T& operator[](uint32_t idx) {
+        assert(idx < size());
+        return segments.load(std::memory_order_acquire)[idx >> segment_bits][idx & (segment_size - 1)];
+      }
+
+      // Returns the new entry, at index size() - 1
+      T& grow() {
+        uint32_t n = count.load(std::memory_order_relaxed);
+        if (n == num_segments * segment_size) {
+          if (num_segments == max_segments) {
+            // Old directories are kept, someone might be reading them
+            max_segments = max_segments ? max_segments * 2 : 8;
+            std::unique_ptr< T*[] > dir(new T*[max_segments]);
+            for (uint32_t i = 0; i < num_segments; ++i)
+              dir[i] = directories.back()[i];
+            segments.store(dir.get(), std::memory_order_release);
+            directories.push_back(std::move(dir));
+          }
+          directories.back()[num_segments++] = new T[segment_size];
+        }
+        count.store(n + 1, std::memory_order_release);
+        return (*this)[n];
+      }
+    };
+
+  }
+
+}
+
+#endif
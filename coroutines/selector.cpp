@@ -0,0 +1,182 @@
+#include "coroutines.h"
+
+namespace Coroutines {
+
+  using namespace internal;
+
+  // -------------------------------------------------------------
+  TSelector::TSelector() : ready(new TReadyList) {
+    ready->has_ready = createEvent();
+  }
+
+  TSelector::~TSelector() {
+    for (auto& s : sources) {
+      if (s.in_use)
+        remove(s.id);
+    }
+    destroyEvent(ready->has_ready);
+  }
+
+  // -------------------------------------------------------------
+  // A released channel, like a closed one, is always ready
+  bool TSelector::isReadyNow(TSource& s) {
+    switch (s.event_type) {
+    case EVT_CHANNEL_CAN_PULL: {
+      auto c = TBaseChan::findChannelByHandle(s.channel.handle);
+      return !c || c->closed() || !c->empty(); }
+    case EVT_CHANNEL_CAN_PUSH: {
+      auto c = TBaseChan::findChannelByHandle(s.channel.handle);
+      return !c || c->closed() || !c->full(); }
+    default:
+      return io_events.isReady(&s);
+    }
+  }
+
+  void TSelector::arm(TSource& s) {
+    assert(!s.armed);
+    if (isReadyNow(s)) {
+      enqueue(s);
+      return;
+    }
+    switch (s.event_type) {
+    case EVT_CHANNEL_CAN_PULL:
+      TBaseChan::findChannelByHandle(s.channel.handle)->waiting_for_pull.append(&s);
+      break;
+    case EVT_CHANNEL_CAN_PUSH:
+      TBaseChan::findChannelByHandle(s.channel.handle)->waiting_for_push.append(&s);
+      break;
+    default:
+      io_events.add(&s);
+      break;
+    }
+    s.armed = true;
+  }
+
+  void TSelector::disarm(TSource& s) {
+    if (!s.armed)
+      return;
+    switch (s.event_type) {
+    case EVT_CHANNEL_CAN_PULL:
+    case EVT_CHANNEL_CAN_PUSH: {
+      auto c = TBaseChan::findChannelByHandle(s.channel.handle);
+      if (c) {
+        auto& waiters = (s.event_type == EVT_CHANNEL_CAN_PULL) ? c->waiting_for_pull : c->waiting_for_push;
+        waiters.detach(&s);
+      }
+      break; }
+    default:
+      io_events.del(&s);
+      break;
+    }
+    s.armed = false;
+  }
+
+  void TSelector::enqueue(TSource& s) {
+    if (s.queued)
+      return;
+    s.queued = true;
+    s.ready_list->ids.push_back(s.id);
+    setEvent(s.ready_list->has_ready);
+  }
+
+  // The channel or the socket has already detached it from its list
+  void internal::selectorSourceReady(TWatchedEvent* we) {
+    auto s = static_cast<TSelector::TSource*>(we);
+    assert(s->in_use && s->armed);
+    s->armed = false;
+    TSelector::enqueue(*s);
+  }
+
+  // -------------------------------------------------------------
+  int TSelector::add(TWatchedEvent we) {
+    assert(we.event_type == EVT_CHANNEL_CAN_PULL || we.event_type == EVT_CHANNEL_CAN_PUSH
+        || we.event_type == EVT_SOCKET_IO_CAN_READ || we.event_type == EVT_SOCKET_IO_CAN_WRITE);
+    // The mpmc channels only wake up those counted in the channel, and the
+    // timers don't wake up the waiting lists, they are found by timeout
+    assert(we.event_type == EVT_SOCKET_IO_CAN_READ || we.event_type == EVT_SOCKET_IO_CAN_WRITE
+        || (we.channel.handle.class_id != TChanHandle::CT_MPMC
+            && we.channel.handle.class_id != TChanHandle::CT_TIMER));
+    TSchedLock lock;
+    int id;
+    if (free_ids.empty()) {
+      id = (int)sources.size();
+      sources.emplace_back();
+    }
+    else {
+      id = free_ids.back();
+      free_ids.pop_back();
+    }
+    auto& s = sources[id];
+    static_cast<TWatchedEvent&>(s) = we;
+    s.owner = current();
+    s.in_selector = true;
+    s.ready_list = ready.get();
+    s.id = id;
+    s.in_use = true;
+    s.armed = false;
+    s.queued = false;
+    ++num_sources;
+    arm(s);
+    return id;
+  }
+
+  void TSelector::remove(int id) {
+    TSchedLock lock;
+    assert(id >= 0 && (size_t)id < sources.size());
+    auto& s = sources[id];
+    assert(s.in_use);
+    disarm(s);
+    s.in_use = false;
+    s.queued = false;
+    free_ids.push_back(id);
+    --num_sources;
+    if (last_selected == id)
+      last_selected = -1;
+  }
+
+  // -------------------------------------------------------------
+  int TSelector::select(TTimeDelta timeout) {
+    TSchedLock lock;
+
+    // The one returned last time is watched again
+    if (last_selected >= 0) {
+      auto& s = sources[last_selected];
+      if (s.in_use && !s.armed && !s.queued)
+        arm(s);
+      last_selected = -1;
+    }
+
+    TTimeStamp deadline;
+    if (timeout != no_timeout)
+      deadline = Time::now() + timeout;
+
+    while (true) {
+      while (!ready->ids.empty()) {
+        int id = ready->ids.front();
+        ready->ids.pop_front();
+        auto& s = sources[id];
+        if (!s.queued)
+          continue;
+        s.queued = false;
+        last_selected = id;
+        return id;
+      }
+
+      if (!num_sources)
+        return -1;
+
+      clearEvent(ready->has_ready);
+      TWatchedEvent wes[2] = { TWatchedEvent(ready->has_ready), TWatchedEvent() };
+      int n = 1;
+      if (timeout != no_timeout) {
+        auto time_left = deadline - Time::now();
+        if (time_left <= TTimeDelta::zero())
+          return -1;
+        wes[n++] = TWatchedEvent(time_left);
+      }
+      if (wait(wes, n) != 0)
+        return -1;
+    }
+  }
+
+}
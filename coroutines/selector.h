@@ -0,0 +1,77 @@
+#ifndef INC_COROUTINES_SELECTOR_H_
+#define INC_COROUTINES_SELECTOR_H_
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace Coroutines {
+
+  namespace internal {
+    // Called by wakeUp for the events owned by a selector
+    void selectorSourceReady(TWatchedEvent* we);
+  }
+
+  // -------------------------------------------------------------
+  // Waits for any of a set of channels and sockets which can be large and
+  // change at runtime. The sources stay registered between the calls to
+  // select, which only deals with the ones that have become ready. The
+  // ready ones are returned in fifo order, so all of them get their turn.
+  // A selector must only be used by one coroutine.
+  class TSelector {
+
+    // wakeUp writes here while the owner sleeps, and the selector might be
+    // in a shared stack which is not in place then. So it lives in the heap
+    struct TReadyList {
+      std::deque< int > ids;         // Might have ids removed after being queued
+      TEventID          has_ready = 0;
+    };
+
+    struct TSource : public TWatchedEvent {
+      TReadyList* ready_list = nullptr;
+      int         id = -1;
+      bool        in_use = false;
+      bool        armed = false;     // In the waiting list of the channel/socket
+      bool        queued = false;    // In the ready list
+    };
+
+    std::deque< TSource > sources;   // Don't move, the channels point to them
+    std::vector< int >    free_ids;
+    std::unique_ptr< TReadyList > ready;
+    size_t                num_sources = 0;
+    int                   last_selected = -1;
+
+    // Must be called with the sched lock taken
+    bool isReadyNow(TSource& s);
+    void arm(TSource& s);
+    void disarm(TSource& s);
+    static void enqueue(TSource& s);
+
+    friend void internal::selectorSourceReady(TWatchedEvent* we);
+
+  public:
+
+    TSelector();
+    ~TSelector();
+    TSelector(const TSelector&) = delete;
+    TSelector& operator=(const TSelector&) = delete;
+
+    // canRead/canWrite of a socket or an in memory channel. The timers of
+    // every() & after() can't be added, wait for them with choose. Returns the
+    // id of the source, to be used in select & remove
+    int    add(TWatchedEvent we);
+    void   remove(int id);
+    size_t size() const { return num_sources; }
+    const TWatchedEvent& source(int id) const { return sources[id]; }
+
+    // Returns the id of a ready source, sleeping until there is one, or -1
+    // if the timeout expires first or there are no sources. The source
+    // returned is registered again in the next call, so it's reported
+    // again only if it's still ready: it still has data, it's closed, or
+    // the socket gets new data. Closed channels stay ready until removed
+    int    select(TTimeDelta timeout = no_timeout);
+  };
+
+}
+
+#endif
@@ -0,0 +1,200 @@
+#include "coroutines.h"
+#include "stacks.h"
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+namespace Coroutines {
+
+  namespace internal {
+
+    TStackPools stack_pools;
+
+    // Implemented in coroutines.cpp
+    const fcontext_stack_t* currentStack();
+
+    static size_t pageSize() {
+#ifdef _WIN32
+      SYSTEM_INFO si;
+      ::GetSystemInfo(&si);
+      return si.dwPageSize;
+#else
+      return (size_t)::sysconf(_SC_PAGESIZE);
+#endif
+    }
+
+    // -------------------------------------------------------
+    size_t TStackPools::sizeOf(eStackSize size_class) {
+      static const size_t sizes[STACK_SIZES_COUNT] = {
+        8 * 1024            // STACK_TINY
+      , 32 * 1024           // STACK_SMALL
+      , 64 * 1024           // STACK_DEFAULT
+      , 256 * 1024          // STACK_LARGE
+      , 1024 * 1024         // STACK_HUGE
+      , 256 * 1024          // STACK_SHARED
+      };
+      assert(size_class >= 0 && size_class < STACK_SIZES_COUNT);
+      return sizes[size_class];
+    }
+
+    TStackPools::~TStackPools() {
+      for (int i = 0; i < STACK_SIZES_COUNT; ++i) {
+        for (auto& s : free_stacks[i])
+          release(s, STACK_SIZES_COUNT);
+      }
+    }
+
+    // -------------------------------------------------------
+    fcontext_stack_t TStackPools::acquire(eStackSize size_class) {
+      auto& pool = free_stacks[size_class];
+      if (!pool.empty()) {
+        auto s = pool.back();
+        pool.pop_back();
+        return s;
+      }
+
+      installOverflowHandler();
+
+      size_t guard_size = pageSize();
+      size_t stack_size = sizeOf(size_class);
+      size_t total_size = guard_size + stack_size;
+
+#ifdef _WIN32
+      char* base = (char*)::VirtualAlloc(nullptr, total_size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+      assert(base);
+      DWORD old_protect;
+      ::VirtualProtect(base, guard_size, PAGE_NOACCESS, &old_protect);
+#else
+      char* base = (char*)::mmap(nullptr, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+      assert(base != MAP_FAILED);
+      ::mprotect(base, guard_size, PROT_NONE);
+#endif
+
+      // Stacks grow down, so the top of the stack is the end of the memory
+      fcontext_stack_t s;
+      s.sptr = base + total_size;
+      s.ssize = stack_size;
+      return s;
+    }
+
+    // Stacks released with STACK_SIZES_COUNT are returned to the OS
+    void TStackPools::release(fcontext_stack_t& stack, eStackSize size_class) {
+      if (!stack.sptr)
+        return;
+      if (size_class < STACK_SIZES_COUNT) {
+        free_stacks[size_class].push_back(stack);
+      }
+      else {
+        size_t total_size = pageSize() + stack.ssize;
+        char* base = (char*)stack.sptr - total_size;
+#ifdef _WIN32
+        ::VirtualFree(base, 0, MEM_RELEASE);
+#else
+        ::munmap(base, total_size);
+#endif
+      }
+      stack.sptr = nullptr;
+      stack.ssize = 0;
+    }
+
+    // -------------------------------------------------------
+    bool isInGuardPage(const fcontext_stack_t& stack, const void* addr) {
+      auto guard_end = (const char*)stack.sptr - stack.ssize;
+      auto guard_start = guard_end - pageSize();
+      return addr >= guard_start && addr < guard_end;
+    }
+
+#ifdef _WIN32
+
+    // Windows already reports the stack overflow as an access violation
+    void TStackPools::installOverflowHandler() {
+    }
+
+#else
+
+    static struct sigaction prev_segv_action;
+    static struct sigaction prev_bus_action;
+
+    static void onMemoryFault(int sig, siginfo_t* info, void* uctx) {
+      auto stack = currentStack();
+      if (stack && isInGuardPage(*stack, info->si_addr)) {
+        auto h = current();
+        char msg[128];
+        int n = snprintf(msg, sizeof(msg), "Coroutine %04x.%04x has overflowed its stack of %d bytes\n", h.id, h.age, (int)stack->ssize);
+        auto rc = ::write(STDERR_FILENO, msg, n);
+        (void)rc;
+        abort();
+      }
+      // Not our business. The previous handler deals with this fault, and
+      // we stay installed for the next ones
+      const struct sigaction& prev = (sig == SIGSEGV) ? prev_segv_action : prev_bus_action;
+      if (prev.sa_flags & SA_SIGINFO) {
+        if (prev.sa_sigaction) {
+          prev.sa_sigaction(sig, info, uctx);
+          return;
+        }
+      }
+      else if (prev.sa_handler == SIG_IGN) {
+        // A real fault would just happen again. Only those sent by kill are ignored
+        if (info->si_code <= 0)
+          return;
+      }
+      else if (prev.sa_handler != SIG_DFL) {
+        prev.sa_handler(sig);
+        return;
+      }
+      // The default action ends the process. The signal is blocked while we
+      // run, so it's delivered when we return
+      ::signal(sig, SIG_DFL);
+      ::raise(sig);
+    }
+
+    // The handler can't run in the stack which has just overflowed
+    struct TAltSignalStack {
+      stack_t ss;
+      TAltSignalStack() {
+        ss.ss_size = 64 * 1024;
+        ss.ss_sp = malloc(ss.ss_size);
+        ss.ss_flags = 0;
+        ::sigaltstack(&ss, nullptr);
+      }
+      ~TAltSignalStack() {
+        stack_t disabled;
+        memset(&disabled, 0, sizeof(disabled));
+        disabled.ss_flags = SS_DISABLE;
+        ::sigaltstack(&disabled, nullptr);
+        free(ss.ss_sp);
+      }
+    };
+
+    void TStackPools::installOverflowHandler() {
+      static thread_local TAltSignalStack alt_stack;
+      (void)alt_stack;
+
+      static bool handler_installed = false;
+      if (handler_installed)
+        return;
+      handler_installed = true;
+
+      struct sigaction sa;
+      memset(&sa, 0, sizeof(sa));
+      sa.sa_sigaction = &onMemoryFault;
+      sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+      sigemptyset(&sa.sa_mask);
+      ::sigaction(SIGSEGV, &sa, &prev_segv_action);
+      ::sigaction(SIGBUS, &sa, &prev_bus_action);
+    }
+
+#endif
+
+  }
+
+}
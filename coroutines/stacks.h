@@ -0,0 +1,43 @@
+#ifndef INC_COROUTINES_STACKS_H_
+#define INC_COROUTINES_STACKS_H_
+
+#include <vector>
+#include "fcontext/fcontext.h"
+
+namespace Coroutines {
+
+  namespace internal {
+
+    // -------------------------------------------------------------
+    // Stacks are reserved with a non accessible guard page below them, so
+    // an overflow faults instead of corrupting the memory of someone else.
+    // Released stacks are kept in a pool per size class to be reused.
+    // All methods must be called with the sched lock taken.
+    class TStackPools {
+
+      std::vector< fcontext_stack_t > free_stacks[STACK_SIZES_COUNT];
+
+    public:
+
+      ~TStackPools();
+
+      static size_t sizeOf(eStackSize size_class);
+
+      fcontext_stack_t acquire(eStackSize size_class);
+      void release(fcontext_stack_t& stack, eStackSize size_class);
+
+      // Prints a diagnostic when a coroutine touches the guard page of
+      // its stack. Must be called by each thread running coroutines
+      static void installOverflowHandler();
+    };
+
+    extern TStackPools stack_pools;
+
+    // The guard page of the stack is at the start of the reserved memory
+    bool isInGuardPage(const fcontext_stack_t& stack, const void* addr);
+
+  }
+
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include <chrono>
+#include <cstdio>
 #include "timeline.h"
 #include "coroutines.h"
 
@@ -7,7 +8,6 @@ namespace Coroutines {
   void wakeUp(TWatchedEvent* we);
 
   TTimeStamp current_timestamp;
-  TList      waiting_for_timeouts;
 
   namespace Time {
 
@@ -42,25 +42,166 @@ namespace Coroutines {
 
   namespace internal {
 
+    // -------------------------------------------------------
+    // Hierarchical timing wheel. Each tick is 2^20 ns (~1ms), and each
+    // level has 256 buckets covering 256 times the range of the previous
+    // level. Events are moved to lower levels as the time advances, and
+    // once their tick has arrived, to the due list where the exact
+    // timestamp is checked.
+    struct TTimingWheel {
+
+      static const int      num_levels = 4;
+      static const int      bits_per_level = 8;
+      static const int      buckets_per_level = 1 << bits_per_level;
+      static const uint32_t bucket_mask = buckets_per_level - 1;
+      static const int      ns_per_tick_bits = 20;
+
+      static const uint32_t due_bucket = num_levels * buckets_per_level;
+      static const uint32_t no_bucket = ~0u;
+
+      TList     buckets[num_levels * buckets_per_level];
+      TList     due;                  // Tick arrived, waiting for the exact time
+      uint64_t  current_tick = 0;
+      uint32_t  num_in_buckets = 0;   // Not counting the due ones
+
+      static uint64_t tickOf(TTimeStamp t) {
+        auto ns = t.time_since_epoch().count();
+        return ns > 0 ? (uint64_t)ns >> ns_per_tick_bits : 0;
+      }
+
+      TList& listOf(uint32_t bucket) {
+        return bucket == due_bucket ? due : buckets[bucket];
+      }
+
+      void insert(TWatchedEvent* we) {
+        uint64_t tick = tickOf(we->time.time_to_trigger);
+        uint32_t bucket = due_bucket;
+        if (tick > current_tick) {
+          uint64_t delta = tick - current_tick;
+          int level = 0;
+          while (level < num_levels - 1 && delta >= (1ULL << (bits_per_level * (level + 1))))
+            ++level;
+          // Too far in the future, park it in the last slot of the wheel
+          const uint64_t max_delta = (1ULL << (bits_per_level * num_levels)) - 1;
+          if (delta > max_delta)
+            tick = current_tick + max_delta;
+          bucket = level * buckets_per_level + ((tick >> (bits_per_level * level)) & bucket_mask);
+          ++num_in_buckets;
+        }
+        we->time.bucket = bucket;
+        listOf(bucket).append(we);
+      }
+
+      void remove(TWatchedEvent* we) {
+        auto bucket = we->time.bucket;
+        if (bucket == no_bucket)
+          return;
+        if (bucket != due_bucket)
+          --num_in_buckets;
+        listOf(bucket).detach(we);
+        we->time.bucket = no_bucket;
+      }
+
+      // Reinserts all the events of the bucket relative to the current tick
+      void cascade(int level) {
+        auto idx = (current_tick >> (bits_per_level * level)) & bucket_mask;
+        TList events;
+        std::swap(events, buckets[level * buckets_per_level + idx]);
+        while (auto we = events.detachFirst<TWatchedEvent>()) {
+          --num_in_buckets;
+          insert(we);
+        }
+      }
+
+      void advance(uint64_t new_tick) {
+        if (!current_tick || !num_in_buckets) {
+          if (new_tick > current_tick)
+            current_tick = new_tick;
+          return;
+        }
+        while (current_tick < new_tick && num_in_buckets) {
+          ++current_tick;
+          // Cascade from the upper levels when the lower ones wrap around
+          for (int level = num_levels - 1; level > 0; --level) {
+            if ((current_tick & ((1ULL << (bits_per_level * level)) - 1)) == 0)
+              cascade(level);
+          }
+          cascade(0);
+        }
+        if (current_tick < new_tick)
+          current_tick = new_tick;
+      }
+
+      // Only the first non empty bucket of each level needs to be checked.
+      // Upper levels give the start of the bucket range, which is lower
+      // than the real time of the events stored there
+      TTimeDelta timeToNext(TTimeStamp now) const {
+        TTimeDelta best = TTimeDelta::max();
+        auto we = static_cast<const TWatchedEvent*>(due.first);
+        while (we) {
+          auto delta = we->time.time_to_trigger - now;
+          if (delta < best)
+            best = delta;
+          we = static_cast<const TWatchedEvent*>(we->next);
+        }
+        if (!num_in_buckets)
+          return best;
+        auto now_ns = now.time_since_epoch().count();
+        for (int level = 0; level < num_levels; ++level) {
+          int shift = bits_per_level * level;
+          uint64_t base = current_tick >> shift;
+          for (uint64_t k = 1; k <= buckets_per_level; ++k) {
+            auto idx = (base + k) & bucket_mask;
+            if (buckets[level * buckets_per_level + idx].empty())
+              continue;
+            uint64_t tick = (base + k) << shift;
+            auto delta = TTimeDelta((long long)(tick << ns_per_tick_bits) - now_ns);
+            if (delta < best)
+              best = delta;
+            break;
+          }
+        }
+        return best;
+      }
+
+      void update(TTimeStamp now) {
+        advance(tickOf(now));
+        auto we = static_cast<TWatchedEvent*>(due.first);
+        while (we) {
+          auto next = static_cast<TWatchedEvent*>(we->next);
+          assert(we->event_type == EVT_TIMEOUT);
+          if (we->time.time_to_trigger <= now) {
+            remove(we);
+            wakeUp(we);
+          }
+          we = next;
+        }
+      }
+
+    };
+
+    static TTimingWheel timing_wheel;
+
     void checkTimeoutEvents() {
       current_timestamp = Time::now();
-      auto we = static_cast<TWatchedEvent*>( waiting_for_timeouts.first );
-      while (we) {
-        assert(we->event_type == EVT_TIMEOUT);
-        if (we->time.time_to_trigger <= current_timestamp)
-          wakeUp( we );
-        we = static_cast<TWatchedEvent*>(we->next);
-      }
+      timing_wheel.update(current_timestamp);
     }
 
     void registerTimeoutEvent(TWatchedEvent* we) {
       assert(we->event_type == EVT_TIMEOUT);
-      waiting_for_timeouts.append(we);
+      if (!timing_wheel.current_tick)
+        timing_wheel.current_tick = TTimingWheel::tickOf(Time::now());
+      timing_wheel.insert(we);
     }
 
     void unregisterTimeoutEvent(TWatchedEvent* we) {
       assert(we->event_type == EVT_TIMEOUT);
-      waiting_for_timeouts.detach(we);
+      timing_wheel.remove(we);
+    }
+
+    TTimeDelta timeToNextTimeout(TTimeStamp now) {
+      auto delta = timing_wheel.timeToNext(now);
+      return delta < TTimeDelta::zero() ? TTimeDelta::zero() : delta;
     }
 
   }
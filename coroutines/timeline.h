@@ -56,6 +56,10 @@ namespace Coroutines {
     void registerTimeoutEvent(TWatchedEvent* we);
     void unregisterTimeoutEvent(TWatchedEvent* we);
 
+    // Time left until the earliest timeout might fire. It can be a bit
+    // early, but never late. TTimeDelta::max() if there are no timeouts
+    TTimeDelta timeToNextTimeout(TTimeStamp now);
+
   }
 
 }
@@ -0,0 +1,307 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include "coroutines.h"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define CO_TRACE_USE_TSC
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define CO_TRACE_USE_TSC
+#endif
+
+namespace Coroutines {
+
+  namespace internal {
+
+    std::atomic<bool> trace_recording{ false };
+
+    // -------------------------------------------------------------
+    // Reading the tsc is much cheaper than asking the OS for the time. The
+    // ticks are converted to time when exporting
+    static uint64_t traceTicks() {
+#ifdef CO_TRACE_USE_TSC
+      return __rdtsc();
+#else
+      return (uint64_t)Time::now().time_since_epoch().count();
+#endif
+    }
+
+    struct TTraceRecord {
+      uint64_t    ticks;
+      uint64_t    arg;
+      uint32_t    co_id;
+      uint16_t    co_age;             // Low bits, enough to tell apart the reuses of the slot
+      uint8_t     trace_event;
+      uint8_t     event_type;
+    };
+
+    // Only the owner thread writes in the ring
+    struct TTraceRing {
+      std::unique_ptr< TTraceRecord[] > records;
+      uint64_t                          mask = 0;
+      uint64_t                          count = 0;     // Ever recorded. Wraps around the size of records
+
+      void reset(size_t new_size) {
+        if (mask + 1 != new_size || !records)
+          records.reset(new TTraceRecord[new_size]);
+        mask = new_size - 1;
+        count = 0;
+      }
+    };
+
+    // The rings are reused by each start, and never freed, so the threads can
+    // keep a plain pointer to theirs. Rings [0..num_worker_rings) are for the
+    // thread calling start, which also runs the worker 0, and the other workers
+    std::mutex                                   trace_rings_mutex;
+    std::vector< std::unique_ptr< TTraceRing > > trace_rings;
+    size_t                                       num_worker_rings = 0;
+    size_t                                       trace_ring_size = 0;
+    TTimeStamp                                   trace_start_time;
+    uint64_t                                     trace_start_ticks = 0;
+
+    static thread_local TTraceRing*              ring_of_this_thread = nullptr;
+
+    void attachTraceRingOfWorker(int idx) {
+      if (idx > 0 && (size_t)idx < num_worker_rings)
+        ring_of_this_thread = trace_rings[idx].get();
+    }
+
+    // The first record of a thread without a preallocated ring
+    static TTraceRing* attachNewTraceRing() {
+      std::lock_guard< std::mutex > guard(trace_rings_mutex);
+      trace_rings.emplace_back(new TTraceRing);
+      auto ring = trace_rings.back().get();
+      ring->reset(trace_ring_size);
+      ring_of_this_thread = ring;
+      return ring;
+    }
+
+    void recordTrace(eTraceEvent trace_event, THandle h, eEventType event_type, uint64_t arg) {
+      auto ring = ring_of_this_thread;
+      if (!ring)
+        ring = attachNewTraceRing();
+      auto& r = ring->records[ring->count & ring->mask];
+      ++ring->count;
+      r.ticks = traceTicks();
+      r.arg = arg;
+      r.co_id = h.id;
+      r.co_age = (uint16_t)h.age;
+      r.trace_event = trace_event;
+      r.event_type = (uint8_t)event_type;
+    }
+
+    uint64_t traceArgOf(const TWatchedEvent* we) {
+      switch (we->event_type) {
+      case EVT_CHANNEL_CAN_PUSH:
+      case EVT_CHANNEL_CAN_PULL:
+        return we->channel.handle.index;
+      case EVT_SOCKET_IO_CAN_READ:
+      case EVT_SOCKET_IO_CAN_WRITE:
+        return (uint64_t)we->io.fd;
+      case EVT_USER_EVENT:
+        return we->user_event.event_id;
+      case EVT_COROUTINE_ENDS:
+        return we->coroutine.handle.id;
+      case EVT_IO_COMPLETED:
+        return (uint64_t)(int64_t)we->ring.result;
+      default:
+        return 0;
+      }
+    }
+
+    static const char* traceNameOf(uint8_t event_type) {
+      switch (event_type) {
+      case EVT_USER_EVENT:          return "user event";
+      case EVT_COROUTINE_ENDS:      return "coroutine ends";
+      case EVT_TIMEOUT:             return "timeout";
+      case EVT_SOCKET_IO_CAN_READ:  return "socket can read";
+      case EVT_SOCKET_IO_CAN_WRITE: return "socket can write";
+      case EVT_CHANNEL_CAN_PUSH:    return "channel can push";
+      case EVT_CHANNEL_CAN_PULL:    return "channel can pull";
+      case EVT_IO_COMPLETED:        return "io completed";
+      case EVT_SYNC_ACQUIRED:       return "sync acquired";
+      default:                      return "unknown";
+      }
+    }
+
+    // -------------------------------------------------------------
+    // State of each coroutine while converting the records to slices
+    struct TTraceTrack {
+      int         tid = 0;
+      bool        running = false;
+      double      run_start = 0.0;
+      bool        wait_requested = false;    // Wait begin seen, the suspend is still to come
+      bool        waiting = false;
+      double      wait_start = 0.0;
+      uint8_t     waiting_for = EVT_INVALID;
+      uint32_t    num_watched = 0;
+    };
+
+  }
+
+  // -------------------------------------------------------------
+  namespace Trace {
+
+    using namespace internal;
+
+    void start(size_t max_events_per_thread) {
+      size_t n = 2;
+      while (n < max_events_per_thread)
+        n *= 2;
+      std::lock_guard< std::mutex > guard(trace_rings_mutex);
+      trace_ring_size = n;
+
+      // This thread and the workers record without allocating
+      size_t num_workers = std::max(1u, std::thread::hardware_concurrency());
+      if (num_worker_rings < num_workers)
+        num_worker_rings = num_workers;
+      while (trace_rings.size() < num_worker_rings)
+        trace_rings.emplace_back(new TTraceRing);
+      for (auto& ring : trace_rings)
+        ring->reset(n);
+      ring_of_this_thread = trace_rings[0].get();
+
+      trace_start_time = Time::now();
+      trace_start_ticks = traceTicks();
+      trace_recording.store(true, std::memory_order_relaxed);
+    }
+
+    void stop() {
+      trace_recording.store(false, std::memory_order_relaxed);
+    }
+
+    bool isRecording() {
+      return isTracing();
+    }
+
+    // -------------------------------------------------------------
+    bool exportChromeJSON(const char* filename) {
+      FILE* f = fopen(filename, "wb");
+      if (!f)
+        return false;
+
+      std::lock_guard< std::mutex > guard(trace_rings_mutex);
+
+      // Merge what is still in the rings, in time order
+      std::vector< TTraceRecord > records;
+      for (auto& ring : trace_rings) {
+        uint64_t size = ring->mask + 1;
+        uint64_t first = ring->count > size ? ring->count - size : 0;
+        for (uint64_t i = first; i < ring->count; ++i)
+          records.push_back(ring->records[i & ring->mask]);
+      }
+      std::stable_sort(records.begin(), records.end(), [](const TTraceRecord& a, const TTraceRecord& b) {
+        return a.ticks < b.ticks;
+      });
+
+      // Microseconds since start
+      double us_per_tick = 1e-3;
+#ifdef CO_TRACE_USE_TSC
+      uint64_t elapsed_ticks = traceTicks() - trace_start_ticks;
+      double elapsed_us = std::chrono::duration<double, std::micro>(Time::now() - trace_start_time).count();
+      if (elapsed_ticks)
+        us_per_tick = elapsed_us / (double)elapsed_ticks;
+#endif
+      auto timeOf = [&](uint64_t ticks) {
+        return (double)(int64_t)(ticks - trace_start_ticks) * us_per_tick;
+      };
+
+      fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+      fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"coroutines\"}}");
+      fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"io\"}}");
+
+      // Each coroutine gets its own track, also when its slot is reused
+      std::map< uint64_t, TTraceTrack > tracks;
+      int next_tid = 1;
+      auto trackOf = [&](const TTraceRecord& r) -> TTraceTrack& {
+        uint64_t key = ((uint64_t)r.co_age << 32) | r.co_id;
+        auto it = tracks.find(key);
+        if (it != tracks.end())
+          return it->second;
+        auto& t = tracks[key];
+        t.tid = next_tid++;
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"co %u.%u\"}}", t.tid, r.co_id, r.co_age);
+        return t;
+      };
+
+      for (auto& r : records) {
+        double ts = timeOf(r.ticks);
+
+        if (r.trace_event == TRACE_IO_READY) {
+          fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":0,\"ts\":%.3f,\"args\":{\"source\":%lld}}",
+            traceNameOf(r.event_type), ts, (long long)r.arg);
+          continue;
+        }
+
+        auto& t = trackOf(r);
+        switch (r.trace_event) {
+
+        case TRACE_RESUME:
+          t.running = true;
+          t.run_start = ts;
+          break;
+
+        case TRACE_SUSPEND:
+          if (t.running)
+            fprintf(f, ",\n{\"name\":\"run\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", t.tid, t.run_start, ts - t.run_start);
+          t.running = false;
+          if (t.wait_requested) {
+            t.wait_requested = false;
+            t.waiting = true;
+            t.wait_start = ts;
+          }
+          break;
+
+        case TRACE_END:
+          if (t.running)
+            fprintf(f, ",\n{\"name\":\"run\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}", t.tid, t.run_start, ts - t.run_start);
+          if (t.waiting)
+            fprintf(f, ",\n{\"name\":\"wait exited\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"waiting_for\":\"%s\"}}",
+              t.tid, t.wait_start, ts - t.wait_start, traceNameOf(t.waiting_for));
+          t.running = false;
+          t.waiting = false;
+          fprintf(f, ",\n{\"name\":\"ends\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", t.tid, ts);
+          break;
+
+        case TRACE_WAIT_BEGIN:
+          t.wait_requested = true;
+          t.waiting_for = r.event_type;
+          t.num_watched = (uint32_t)r.arg;
+          break;
+
+        case TRACE_WAIT_END:
+          if (t.waiting)
+            fprintf(f, ",\n{\"name\":\"wait %s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+              "\"args\":{\"waiting_for\":\"%s\",\"num_watched\":%u,\"woken_by\":\"%s\",\"source\":%lld}}",
+              traceNameOf(r.event_type), t.tid, t.wait_start, ts - t.wait_start,
+              traceNameOf(t.waiting_for), t.num_watched, traceNameOf(r.event_type), (long long)r.arg);
+          t.waiting = false;
+          t.wait_requested = false;
+          break;
+
+        case TRACE_CHANNEL_PUSH:
+        case TRACE_CHANNEL_PULL:
+          fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"args\":{\"chan\":%llu}}",
+            r.trace_event == TRACE_CHANNEL_PUSH ? "push" : "pull", t.tid, ts, (unsigned long long)r.arg);
+          break;
+
+        default:
+          break;
+        }
+      }
+
+      fprintf(f, "\n]}\n");
+      fclose(f);
+      return true;
+    }
+
+  }
+
+}
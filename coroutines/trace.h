@@ -0,0 +1,74 @@
+#ifndef INC_COROUTINES_TRACE_H_
+#define INC_COROUTINES_TRACE_H_
+
+#include <atomic>
+
+namespace Coroutines {
+
+  // -------------------------------------------------------------
+  // Records the activity of the scheduler: coroutines running, waiting and
+  // why they wake up, channel transfers and io readiness. The recorded
+  // events can be exported in the Chrome trace event format, loadable in
+  // chrome://tracing or Perfetto, with one track per coroutine.
+  // start/stop/exportChromeJSON must be called while no coroutine runs.
+  namespace Trace {
+
+    // Each thread records in its own ring of max_events. The rings of the
+    // calling thread and of the workers of runInThreads are preallocated
+    // here, so recording never allocates nor locks in them. Other threads
+    // get their ring when they record for the first time. When a ring is
+    // full, the oldest events are overwritten
+    void start(size_t max_events_per_thread = 1 << 20);
+    void stop();
+    bool isRecording();
+
+    // Writes the events recorded since the last start
+    bool exportChromeJSON(const char* filename);
+
+  }
+
+  namespace internal {
+
+    enum eTraceEvent : uint8_t {
+      TRACE_RESUME
+    , TRACE_SUSPEND
+    , TRACE_END               // Also when exited while waiting
+    , TRACE_WAIT_BEGIN        // event_type of the first event watched, arg the number watched
+    , TRACE_WAIT_END          // event_type of the event waking it up
+    , TRACE_CHANNEL_PUSH      // arg is the index of the channel
+    , TRACE_CHANNEL_PULL
+    , TRACE_IO_READY          // arg is the fd or the result of the ring op
+    };
+
+    // Written by start/stop, read by all the threads
+    extern std::atomic<bool> trace_recording;
+
+    inline bool isTracing() {
+      return trace_recording.load(std::memory_order_relaxed);
+    }
+
+    void recordTrace(eTraceEvent trace_event, THandle h, eEventType event_type, uint64_t arg);
+
+    // Worker idx of runInThreads takes its preallocated ring
+    void attachTraceRingOfWorker(int idx);
+
+    // Costs a test of a global when not recording
+    inline void trace(eTraceEvent trace_event, THandle h, eEventType event_type = EVT_INVALID, uint64_t arg = 0) {
+      if (isTracing())
+        recordTrace(trace_event, h, event_type, arg);
+    }
+
+    // A transfer of the current coroutine
+    inline void traceChannel(eTraceEvent trace_event, TChanHandle h) {
+      if (isTracing())
+        recordTrace(trace_event, current(), EVT_INVALID, h.index);
+    }
+
+    // What the wait was for: the channel index, the fd...
+    uint64_t traceArgOf(const TWatchedEvent* we);
+
+  }
+
+}
+
+#endif
@@ -1,17 +1,25 @@
 #ifndef INC_COROUTINES_WAIT_H_
 #define INC_COROUTINES_WAIT_H_
 
+#include <initializer_list>
+
 namespace Coroutines {
+
+  namespace internal {
+    class TSyncObject;
+  }
   
   // --------------------------
   struct TWatchedEvent : public TListItem {
     THandle        owner;         // maps to current()
     eEventType     event_type;    // Set by the ctor
+    bool           in_selector = false;   // Owned by a TSelector, which gets the wake ups
 
     union {
 
       struct {
         TTimeStamp time_to_trigger;    // Timestamp when will fire
+        uint32_t   bucket;             // Where is stored in the timing wheel
       } time;
 
       struct {
@@ -28,10 +36,24 @@ namespace Coroutines {
 
       struct {
         TChanHandle handle;
+        void*       obj;      // Value of the parked sender/receiver of an unbuffered channel
       } channel;
 
+      struct {
+        int32_t    result;    // Result of the io_uring op (cqe res)
+        uint32_t   slot;      // Slot of the op in the ring, or ring_completed
+      } ring;
+
+      struct {
+        internal::TSyncObject* obj;
+        int32_t    mode;      // Shared or exclusive for the rw locks
+        bool       granted;   // The obj has been acquired for us
+      } sync;
+
     };
 
+    static const uint32_t ring_completed = ~0u;
+
     // Specialized ctors
     TWatchedEvent() : event_type(EVT_INVALID) { }
 
@@ -40,6 +62,7 @@ namespace Coroutines {
     {
       assert( evt == EVT_CHANNEL_CAN_PUSH || evt == EVT_CHANNEL_CAN_PULL );
       channel.handle = new_channel;
+      channel.obj = nullptr;
       event_type = evt;
       owner = current();
     }
@@ -64,6 +87,15 @@ namespace Coroutines {
       owner = current();
     }
 
+    // Wait until the mutex, semaphore... is ours
+    TWatchedEvent(internal::TSyncObject* obj, int mode) {
+      event_type = EVT_SYNC_ACQUIRED;
+      sync.obj = obj;
+      sync.mode = mode;
+      sync.granted = false;
+      owner = current();
+    }
+
     TWatchedEvent(Net::TSocket sock, eEventType evt) {
       assert(evt == EVT_SOCKET_IO_CAN_READ || evt == EVT_SOCKET_IO_CAN_WRITE);
       event_type = evt;
@@ -94,6 +126,54 @@ namespace Coroutines {
   // Wait a user provided function.
   void wait(TWaitConditionFn fn);
 
+  namespace internal {
+    // Sleeps until one of the sources wakes us up, even if they are ready
+    // right now. Returns the index of that source, or -1 if the timeout
+    // expires first, or without sleeping if one of the channels is closed
+    // or released. Must be called with the sched lock taken
+    int waitForSignal(const TWatchedEvent* sources, int nsources, TTimeDelta timeout);
+
+    // Only one waiter is woken up for each elem of a channel. The one
+    // which will not use it passes the wake up to the next one
+    void passSignal(const TWatchedEvent& source);
+  }
+
+  // Condition variable style wait: sleeps until cond() returns true. Instead
+  // of being polled in each loop, cond is only evaluated again when one of
+  // the sources signals (setEvent, a push, pull or close in a channel...), so
+  // it must only depend on the state guarded by them.
+  // Returns false if the timeout expires, or one of the channels gets closed,
+  // before cond becomes true.
+  // cond runs with the sched lock taken until we sleep, so in M:N mode no
+  // signal is lost between a false cond and the registration to the sources
+  template< typename Predicate >
+  bool waitUntil(Predicate cond, const TWatchedEvent* sources, int nsources, TTimeDelta timeout = no_timeout) {
+    TTimeStamp deadline;
+    if (timeout != no_timeout)
+      deadline = Time::now() + timeout;
+    internal::TSchedLock lock;
+    while (!cond()) {
+      TTimeDelta time_left = no_timeout;
+      if (timeout != no_timeout) {
+        time_left = deadline - Time::now();
+        if (time_left <= TTimeDelta::zero())
+          return false;
+      }
+      int idx = internal::waitForSignal(sources, nsources, time_left);
+      if (idx < 0)
+        return cond();
+      if (cond())
+        return true;
+      internal::passSignal(sources[idx]);
+    }
+    return true;
+  }
+
+  template< typename Predicate >
+  bool waitUntil(Predicate cond, std::initializer_list<TWatchedEvent> sources, TTimeDelta timeout = no_timeout) {
+    return waitUntil(cond, sources.begin(), (int)sources.size(), timeout);
+  }
+
   // Wait for another coroutine to finish
   // wait while h is a coroutine handle
   void wait(TWatchedEvent we);
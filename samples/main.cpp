@@ -25,13 +25,9 @@ void dbg(const char *fmt, ...) {
 }
 
 void runUntilAllCoroutinesEnd() {
-  int counter = 0;
-  while (true) {
-    if (!executeActives())
-      break;
-    dbg("%d\r", counter++);
-  }
-  dbg("all done after %d iters\n", counter);
+  auto loops_at_start = getNumLoops();
+  run();
+  dbg("all done after %d iters\n", (int)(getNumLoops() - loops_at_start));
 }
 
 // ---------------------------------------------------------------
@@ -44,6 +40,7 @@ extern void sample_sync();
 extern void sample_go();
 extern void sample_new_channels();
 extern void sample_read_compress_write();
+extern void sample_threads();
 
 // -----------------------------------------------------------
 int main(int argc, char** argv) {
@@ -68,6 +65,7 @@ int main(int argc, char** argv) {
   //sample_go();
   //sample_new_channels();
   //sample_read_compress_write();
+  //sample_threads();
   return 0;
 }
 
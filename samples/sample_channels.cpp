@@ -121,8 +121,221 @@ void test_consumers() {
 
 }
 
+// ----------------------------------------------------------
+// Cost per elem of moving ints between two coroutines one by one, and
+// in batches
+void test_channels_batch() {
+  const int num_items = 1000000;
+  const int batch_size = 256;
+
+  for (int batched = 0; batched < 2; ++batched) {
+    auto ch = TTypedChannel<int>::create(1024);
+    long long sum = 0;
+
+    TScopedTime tm;
+    start([ch, batched]() {
+      if (batched) {
+        int items[batch_size];
+        for (int i = 0; i < num_items; i += batch_size) {
+          int n = (num_items - i < batch_size) ? num_items - i : batch_size;
+          for (int k = 0; k < n; ++k)
+            items[k] = i + k;
+          ch.push(items, n);
+        }
+      }
+      else {
+        for (int i = 0; i < num_items; ++i)
+          ch << i;
+      }
+      close(ch);
+    });
+
+    start([ch, batched, &sum]() {
+      if (batched) {
+        int items[batch_size];
+        while (size_t n = ch.pull(items, batch_size)) {
+          for (size_t k = 0; k < n; ++k)
+            sum += items[k];
+        }
+      }
+      else {
+        int v;
+        while (v << ch)
+          sum += v;
+      }
+    });
+
+    runUntilAllCoroutinesEnd();
+    double ns = std::chrono::duration<double, std::nano>(tm.elapsed()).count();
+    printf("%-12s %6.1f ns/elem. Sum %lld\n", batched ? "push/pull" : "operator<<", ns / num_items, sum);
+    assert(sum == (long long)num_items * (num_items - 1) / 2);
+  }
+}
+
+// ----------------------------------------------------------
+// Two coroutines playing ping-pong with unbuffered channels. Each value
+// goes directly from the sender to the receiver waiting for it, and with
+// direct switching the receiver runs without going back to the loop
+void test_channels_unbuffered() {
+  const int num_round_trips = 100000;
+  for (int n = 0; n < 4; ++n) {
+    size_t capacity = n & 1;
+    bool direct = (n & 2) != 0;
+    enableDirectSwitching(direct);
+    auto ping = TTypedChannel<int>::create(capacity);
+    auto pong = TTypedChannel<int>::create(capacity);
+
+    TScopedTime tm;
+    start([ping, pong]() {
+      for (int i = 0; i < num_round_trips; ++i) {
+        ping << i;
+        int v;
+        v << pong;
+        assert(v == i);
+      }
+      close(ping);
+    });
+    start([ping, pong]() {
+      int v;
+      while (v << ping)
+        pong << v;
+    });
+    runUntilAllCoroutinesEnd();
+
+    double ns = std::chrono::duration<double, std::nano>(tm.elapsed()).count();
+    printf("Capacity %d. Direct switching %d: %6.1f ns/round trip\n", (int)capacity, direct, ns / num_round_trips);
+  }
+}
+
+// ----------------------------------------------------------
+// Same ring of 64 ints, with the capacity known at runtime or at compile
+// time. Best of several runs, to filter the noise
+void test_channels_static() {
+  const int num_runs = 5;
+  const int num_rounds = 20000;
+  const int num_items = 48;
+
+  double best_ns[2] = { 1e9, 1e9 };
+  for (int run = 0; run < num_runs; ++run) {
+    for (int is_static = 0; is_static < 2; ++is_static) {
+      auto ch = is_static ? TTypedChannel<int>::createStatic<64>() : TTypedChannel<int>::create(64);
+      long long sum = 0;
+
+      TScopedTime tm;
+      start([ch, &sum]() {
+        // Fill & drain, so the indices go around the ring
+        for (int r = 0; r < num_rounds; ++r) {
+          for (int i = 0; i < num_items; ++i)
+            ch << i;
+          for (int i = 0; i < num_items; ++i) {
+            int v;
+            v << ch;
+            sum += v;
+          }
+        }
+      });
+      runUntilAllCoroutinesEnd();
+      close(ch);
+
+      double ns = std::chrono::duration<double, std::nano>(tm.elapsed()).count() / (2.0 * num_rounds * num_items);
+      best_ns[is_static] = std::min(best_ns[is_static], ns);
+      assert(sum == (long long)num_rounds * num_items * (num_items - 1) / 2);
+    }
+  }
+  printf("dynamic %5.1f ns/elem\n", best_ns[0]);
+  printf("static  %5.1f ns/elem\n", best_ns[1]);
+}
+
+// ----------------------------------------------------------
+// Fan in from many channels. wait() over an array registers and checks
+// all of them in each call, the selector only deals with those which change
+void test_selector() {
+  const int num_channels = 2000;
+  const int msgs_per_channel = 20;
+
+  for (int use_selector = 0; use_selector < 2; ++use_selector) {
+    std::vector< IntsChannel > chs;
+    for (int i = 0; i < num_channels; ++i)
+      chs.push_back(IntsChannel::create(4));
+    for (auto ch : chs) {
+      start([ch]() {
+        for (int n = 0; n < msgs_per_channel; ++n)
+          ch << n;
+        close(ch);
+      });
+    }
+
+    long long received = 0;
+    TScopedTime tm;
+    start([&]() {
+      int v;
+      if (use_selector) {
+        TSelector selector;
+        for (auto ch : chs)
+          selector.add(canRead(ch));
+        // The ids are given in order
+        while (selector.size()) {
+          int id = selector.select();
+          if (v << chs[id])
+            ++received;
+          else
+            selector.remove(id);
+        }
+      }
+      else {
+        std::vector< TWatchedEvent > wes;
+        for (auto ch : chs)
+          wes.push_back(canRead(ch));
+        while (!wes.empty()) {
+          int idx = wait(wes.data(), (int)wes.size());
+          if (v << chs[idx]) {
+            ++received;
+          }
+          else {
+            wes.erase(wes.begin() + idx);
+            chs.erase(chs.begin() + idx);
+          }
+        }
+      }
+    });
+    runUntilAllCoroutinesEnd();
+    assert(received == (long long)num_channels * msgs_per_channel);
+    printf("%-8s %6.0f ns/msg from %d channels\n", use_selector ? "selector" : "wait",
+      std::chrono::duration<double, std::nano>(tm.elapsed()).count() / received, num_channels);
+  }
+
+  // Channels which are always ready are served in turns
+  std::vector< IntsChannel > busy;
+  for (int i = 0; i < 3; ++i) {
+    busy.push_back(IntsChannel::create(8));
+    start([ch = busy.back()]() {
+      while (ch << 1) { }
+    });
+  }
+  start([&]() {
+    TSelector selector;
+    for (auto ch : busy)
+      selector.add(canRead(ch));
+    int served[3] = { 0, 0, 0 };
+    for (int n = 0; n < 300; ++n) {
+      int id = selector.select();
+      int v;
+      v << busy[id];
+      ++served[id];
+    }
+    printf("Served %d %d %d\n", served[0], served[1], served[2]);
+    for (auto ch : busy)
+      close(ch);
+  });
+  runUntilAllCoroutinesEnd();
+}
+
 // ----------------------------------------------------------
 void sample_channels() {
+  test_selector();
+  test_channels_static();
+  test_channels_unbuffered();
+  test_channels_batch();
   test_consumers();
   //test_channels();
   //test_channels_send_from_main();
@@ -1,4 +1,6 @@
 #include <cstdarg>
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <vector>
 #include "sample.h"
@@ -105,10 +107,97 @@ void test_co1_destroys_co2() {
   });
 }
 
+// ----------------------------------------------------------
+static int recurse(int n) {
+  volatile char frame[256];
+  frame[0] = (char)n;
+  return n > 0 ? recurse(n - 1) + 1 : frame[0];
+}
+
+void test_stack_sizes() {
+  TSimpleDemo demo("test_stack_sizes");
+  // Many small handlers in 8Kb stacks
+  for (int i = 0; i < 100; ++i) {
+    start([]() {
+      wait(10 * Time::MilliSecond);
+    }, STACK_TINY);
+  }
+  // And one deep recursion which would overflow the default 64Kb
+  start([]() {
+    dbg("Deep recursion returned %d\n", recurse(1000));
+  }, STACK_HUGE);
+}
+
+// ----------------------------------------------------------
+void test_shared_stacks() {
+  TSimpleDemo demo("test_shared_stacks");
+  // Idle coroutines only keep a copy of the part of the stack they use
+  auto evt = createEvent();
+  for (int i = 0; i < 1000; ++i) {
+    start([i, evt]() {
+      int id = i;
+      wait(TWatchedEvent(evt));
+      if (id != i)
+        dbg("Co %d: The stack was not restored\n", i);
+      assert(id == i);
+    }, STACK_SHARED);
+  }
+  start([evt]() {
+    wait(100 * Time::MilliSecond);
+    dbg("Waking up the coroutines in the shared stack\n");
+    setEvent(evt);
+  });
+}
+
+// ----------------------------------------------------------
+// Coroutines which end right away, so we measure the cost of start. Small
+// captures are stored inside the coroutine, a std::function allocates when
+// the captures don't fit in it, and big captures go to the heap
+template< typename F >
+static double spawnRate(const char* title, F make_fn) {
+  const int num_runs = 3;
+  const int num_spawns = 200000;
+  double best_rate = 0;
+  for (int run = 0; run < num_runs; ++run) {
+    long long sum = 0;
+    TScopedTime tm;
+    for (int i = 0; i < num_spawns; ++i)
+      start(make_fn(i, &sum), STACK_TINY);
+    runUntilAllCoroutinesEnd();
+    assert(sum == (long long)num_spawns * (num_spawns - 1) / 2);
+    double secs = std::chrono::duration<double>(tm.elapsed()).count();
+    best_rate = std::max(best_rate, num_spawns / secs);
+  }
+  printf("%-28s %10.0f spawns/sec\n", title, best_rate);
+  return best_rate;
+}
+
+void test_spawn_rate() {
+  struct TBig {
+    long long values[16];
+  };
+  spawnRate("lambda, 3 captures", [](int i, long long* sum) {
+    long long extra = 0;
+    return [i, sum, extra]() { *sum += i + extra; };
+  });
+  spawnRate("std::function, 3 captures", [](int i, long long* sum) {
+    long long extra = 0;
+    return TBootFn([i, sum, extra]() { *sum += i + extra; });
+  });
+  spawnRate("lambda, 136 bytes captured", [](int i, long long* sum) {
+    TBig big = {};
+    big.values[0] = i;
+    return [big, sum]() { *sum += big.values[0]; };
+  });
+}
+
 // ----------------------------------------------------------
 void sample_create() {
+  test_spawn_rate();
   for( int i=0; i<10; ++i )
     test_co1_destroys_co2();
   test_self_destroy();
+  test_stack_sizes();
+  test_shared_stacks();
   //test_create_from_co();
 }
@@ -22,7 +22,10 @@ void test_every_and_after() {
 
   auto coT2 = start([t1, t2]() {
     pull(t2);
-    dbg("After t2 timeouts..., closing the 'every' channel t1\n");
+    // Once fired & pulled, the after() timer is released
+    bool released = !isChannel(t2);
+    dbg("After t2 timeouts..., closing the 'every' channel t1. t2 %s\n", released ? "released" : "still alive");
+    assert(released);
     close(t1);
   });
 
@@ -30,6 +33,7 @@ void test_every_and_after() {
     while (pull(t1))
       dbg(".\n");
     dbg("End of events\n");
+    destroy(t1);
   });
 
 }
@@ -1,4 +1,11 @@
+#include <algorithm>
+#include <cstring>
 #include "sample.h"
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using namespace Coroutines;
 using namespace Coroutines::Time;
@@ -200,9 +207,172 @@ void sample_net_choose() {
 
 }
 
+// ----------------------------------------------------------
+// A header and its body go in one call, without copying them together.
+// Uses its own port, the one of the echo is still in TIME_WAIT
+struct TMsgHeader {
+  uint32_t magic;
+  uint32_t body_size;
+};
+
+void sample_net_sendv() {
+  TSimpleDemo demo("sample_net_sendv");
+  auto co_s = start([]() {
+    auto server = Net::listen("127.0.0.1", port + 1, AF_INET);
+    if (!server)
+      return;
+    auto client = Net::accept(server);
+    if (client) {
+      TMsgHeader header;
+      while (Net::recv(client, &header, sizeof(header))) {
+        std::vector< char > body(header.body_size);
+        if (!Net::recv(client, body.data(), body.size()))
+          break;
+        dbg("Server: Received msg %08x with %d bytes\n", header.magic, (int)body.size());
+      }
+      Net::close(client);
+    }
+    Net::close(server);
+  });
+
+  auto co_c = start([]() {
+    Net::TSocket client = Net::connect("127.0.0.1", port + 1);
+    if (!client)
+      return;
+    std::vector< char > body(256 * 1024, 'x');
+    for (uint32_t i = 0; i < 4; ++i) {
+      TMsgHeader header = { 0xc0de0000 + i, (uint32_t)body.size() };
+      Net::TIOVec bufs[2] = { { &header, sizeof(header) }, { body.data(), body.size() } };
+      if (!Net::sendv(client, bufs, 2))
+        break;
+    }
+    Net::close(client);
+  });
+}
+
+// ----------------------------------------------------------
+// The header and a body split in more pieces than IOV_MAX are received in
+// one recvv, while the peer sends them in small pieces
+void sample_net_recvv() {
+  TSimpleDemo demo("sample_net_recvv");
+  const int num_pieces = 1500;
+  const int piece_size = 5;
+
+  start([]() {
+    auto server = Net::listen("127.0.0.1", port + 2, AF_INET);
+    if (!server)
+      return;
+    auto client = Net::accept(server);
+    if (client) {
+      TMsgHeader header;
+      std::vector< char > body(num_pieces * piece_size);
+      std::vector< Net::TIOVec > bufs;
+      bufs.push_back({ &header, sizeof(header) });
+      for (int i = 0; i < num_pieces; ++i)
+        bufs.push_back({ body.data() + i * piece_size, piece_size });
+      bool ok = Net::recvv(client, bufs.data(), (int)bufs.size());
+      for (size_t i = 0; ok && i < body.size(); ++i)
+        ok = body[i] == (char)(i % 251);
+      ok = ok && header.magic == 0xc0de0000 && header.body_size == body.size();
+      dbg("Server: recvv of %d bufs %s\n", (int)bufs.size(), ok ? "ok" : "failed");
+      assert(ok);
+      Net::close(client);
+    }
+    Net::close(server);
+  });
+
+  start([]() {
+    Net::TSocket client = Net::connect("127.0.0.1", port + 2);
+    if (!client)
+      return;
+    std::vector< char > msg(sizeof(TMsgHeader) + num_pieces * piece_size);
+    TMsgHeader header = { 0xc0de0000, num_pieces * piece_size };
+    memcpy(msg.data(), &header, sizeof(header));
+    for (int i = 0; i < num_pieces * piece_size; ++i)
+      msg[sizeof(header) + i] = (char)(i % 251);
+    // Pieces which don't match the bufs of the receiver
+    const size_t chunk = 7;
+    for (size_t offset = 0; offset < msg.size(); offset += chunk) {
+      if (!Net::send(client, msg.data() + offset, std::min(chunk, msg.size() - offset)))
+        break;
+      if ((offset / chunk) % 64 == 0)
+        wait(Time::MilliSecond);
+    }
+    Net::close(client);
+  });
+}
+
+// ----------------------------------------------------------
+#ifndef _WIN32
+static bool openLocalPair(Net::TSocket& a, Net::TSocket& b) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    return false;
+  for (int fd : fds)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  a = fds[0];
+  b = fds[1];
+  return true;
+}
+
+// Sockets ready to send/recv can be used from the main thread, outside any coroutine
+void sample_net_from_main() {
+  TSimpleDemo demo("sample_net_from_main");
+  Net::TSocket a, b;
+  if (!openLocalPair(a, b))
+    return;
+  const char msg[] = "from main";
+  char buf[sizeof(msg)] = { 0 };
+  bool sent = Net::send(a, msg, sizeof(msg));
+  bool recvd = Net::recv(b, buf, sizeof(buf));
+  bool ok = sent && recvd && strcmp(buf, msg) == 0;
+  dbg("Main: send/recv %s\n", ok ? "ok" : "failed");
+  assert(ok);
+  Net::close(a);
+  Net::close(b);
+}
+
+// A coroutine killed while waiting in a recv. The bytes arriving later
+// must not be written in its stack, which is reused by the next coroutine
+void sample_net_exit_while_recv() {
+  TSimpleDemo demo("sample_net_exit_while_recv");
+  Net::TSocket a, b;
+  if (!openLocalPair(a, b))
+    return;
+  auto co_reader = start([b]() {
+    char buf[64];
+    Net::recv(b, buf, sizeof(buf));
+    dbg("Reader: This msg should not be printed\n");
+  });
+  start([a, b, co_reader]() {
+    wait(10 * Time::MilliSecond);
+    exitCo(co_reader);
+    auto co_next = start([]() {
+      char guard[256];
+      memset(guard, 0x5a, sizeof(guard));
+      wait(50 * Time::MilliSecond);
+      bool intact = std::count(guard, guard + sizeof(guard), 0x5a) == sizeof(guard);
+      dbg("Next: Stack %s\n", intact ? "intact" : "overwritten");
+      assert(intact);
+    });
+    std::vector< char > junk(1024, 'j');
+    Net::send(a, junk.data(), junk.size());
+    waitAll(co_next);
+    Net::close(a);
+    Net::close(b);
+  });
+}
+#endif
+
 // ----------------------------------------------------------
 void sample_net() {
   sample_net_echo();
   //sample_net_multiples();
+  sample_net_sendv();
+  sample_net_recvv();
+#ifndef _WIN32
+  sample_net_from_main();
+  sample_net_exit_while_recv();
+#endif
   sample_net_choose();
 }
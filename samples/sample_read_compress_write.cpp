@@ -30,13 +30,18 @@ void test_read_compress_write() {
 
     const char* filename;
     while (filename << files_to_load) {
-      IO::TBuffer buf;
-      if (!IO::loadFile(filename, buf)) {
+      // Load the file directly in the slot of the channel. The buffer
+      // keeps the memory of the previous file stored there
+      IO::TBuffer* buf = buffers.reserve();
+      if (!buf)
+        break;
+      if (!IO::loadFile(filename, *buf)) {
         dbg("Failed to load file %s\n", filename);
+        buffers.unreserve();
         continue;
       }
-      dbg("file %s loaded %ld bytes\n", filename, buf.size());
-      buffers << buf;
+      dbg("file %s loaded %ld bytes\n", filename, buf->size());
+      buffers.commit();
     }
 
     dbg("All files loaded\n");
@@ -46,17 +51,18 @@ void test_read_compress_write() {
   auto c3 = start([buffers]() {
     int idx = 0;
 
-    IO::TBuffer buf;
-    while (buf << buffers) {
+    // Save the buffers while they are still in the channel
+    while (IO::TBuffer* buf = buffers.peek()) {
       
       char filename[64];
       snprintf(filename, sizeof( filename ), "out_%04d.dat", idx++);
       
-      if( !IO::saveFile(filename, buf) ) {
+      bool saved = IO::saveFile(filename, *buf);
+      if (saved)
+        dbg("File %s saved with %ld bytes\n", filename, buf->size());
+      else
         dbg("Failed to save file %s\n", filename);
-        continue;
-      }
-      dbg("File %s saved with %ld bytes\n", filename, buf.size());
+      buffers.release();
     }
     
     dbg("All files saved\n");
@@ -65,6 +71,13 @@ void test_read_compress_write() {
 }
 
 // -----------------------------------------------------------
+// Load the json in chrome://tracing or ui.perfetto.dev to see where each
+// stage of the pipeline waits
 void sample_read_compress_write() {
+  Trace::start();
   test_read_compress_write();
+  Trace::stop();
+  const char* trace_file = "read_compress_write.trace.json";
+  if (Trace::exportChromeJSON(trace_file))
+    dbg("Trace saved in %s\n", trace_file);
 }
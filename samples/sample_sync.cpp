@@ -1,4 +1,6 @@
 #include <cstdarg>
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <vector>
 #include <string>
@@ -262,7 +264,167 @@ void test_download_in_parallel() {
 
 }
 
+// ---------------------------------------------------------
+// Coroutines taking turns in a critical section which yields inside. The
+// mutex hands itself to the next in the queue, while a channel used as a
+// lock wakes up everyone waiting to push when it's released
+void test_mutex_vs_channel() {
+  TSimpleDemo demo("test_mutex_vs_channel");
+  const int num_coros = 100;
+  const int num_iters = 200;
+
+  for (int use_mutex = 0; use_mutex < 2; ++use_mutex) {
+    TMutex mutex;
+    auto ch_lock = TTypedChannel<int>::create(1);
+    int counter = 0;
+    std::vector<int> order;
+
+    TScopedTime tm;
+    for (int i = 0; i < num_coros; ++i) {
+      start([&, i, ch_lock, use_mutex]() {
+        for (int n = 0; n < num_iters; ++n) {
+          if (use_mutex)
+            mutex.lock();
+          else
+            ch_lock << 1;
+          int value = counter;
+          yield();
+          counter = value + 1;
+          if (n == 0)
+            order.push_back(i);
+          if (use_mutex) {
+            mutex.unlock();
+          }
+          else {
+            int v;
+            v << ch_lock;
+          }
+        }
+      });
+    }
+    run();
+    assert(counter == num_coros * num_iters);
+    close(ch_lock);
+
+    // The mutex is taken in the order it was requested
+    bool in_order = true;
+    for (int i = 0; i < (int)order.size(); ++i)
+      in_order &= order[i] == i;
+    dbg("%-7s %6.0f ns per lock. In fifo order: %s\n", use_mutex ? "mutex" : "channel",
+      std::chrono::duration<double, std::nano>(tm.elapsed()).count() / (num_coros * num_iters),
+      in_order ? "yes" : "no");
+  }
+}
+
+// ---------------------------------------------------------
+void test_locks() {
+  TSimpleDemo demo("test_locks");
+
+  // At most 3 coroutines inside at the same time
+  static TSemaphore slots(3);
+  static int inside = 0;
+  static int max_inside = 0;
+  for (int i = 0; i < 10; ++i) {
+    start([]() {
+      slots.acquire();
+      ++inside;
+      max_inside = std::max(max_inside, inside);
+      wait(Time::MilliSecond);
+      --inside;
+      slots.release();
+    });
+  }
+
+  // Readers share the lock, writers get it alone
+  static TRWLock rwlock;
+  static int readers = 0;
+  static bool writing = false;
+  static int rw_conflicts = 0;
+  for (int i = 0; i < 10; ++i) {
+    start([i]() {
+      for (int n = 0; n < 5; ++n) {
+        if (i % 4 == 0) {
+          rwlock.lock();
+          if (readers || writing)
+            ++rw_conflicts;
+          writing = true;
+          yield();
+          writing = false;
+          rwlock.unlock();
+        }
+        else {
+          rwlock.lockShared();
+          if (writing)
+            ++rw_conflicts;
+          ++readers;
+          yield();
+          --readers;
+          rwlock.unlockShared();
+        }
+      }
+    });
+  }
+
+  // A queue guarded by a mutex & a condition variable
+  static TMutex queue_mutex;
+  static TCondVar queue_not_empty;
+  static std::vector<int> queue;
+  static int sum = 0;
+  for (int i = 0; i < 3; ++i) {
+    start([]() {
+      queue_mutex.lock();
+      while (true) {
+        while (queue.empty())
+          queue_not_empty.wait(queue_mutex);
+        int v = queue.back();
+        queue.pop_back();
+        if (v < 0)
+          break;
+        sum += v;
+      }
+      queue_mutex.unlock();
+    });
+  }
+  start([]() {
+    for (int i = 1; i <= 100; ++i) {
+      queue_mutex.lock();
+      queue.push_back(i);
+      queue_not_empty.notifyOne();
+      queue_mutex.unlock();
+      if (i % 10 == 0)
+        yield();
+    }
+    queue_mutex.lock();
+    queue.insert(queue.begin(), { -1, -1, -1 });
+    queue_not_empty.notifyAll();
+    queue_mutex.unlock();
+  });
+
+  // The acquisition can be combined with a timeout, or other events
+  static TMutex busy;
+  start([]() {
+    busy.lock();
+    wait(20 * Time::MilliSecond);
+    busy.unlock();
+  });
+  start([]() {
+    TWatchedEvent wes[2] = { canLock(busy), 5 * Time::MilliSecond };
+    bool timed_out = wait(wes, 2) == 1;
+    bool locked = busy.lock(50 * Time::MilliSecond);
+    dbg("%s while busy, then %s\n", timed_out ? "Timed out" : "Did not time out", locked ? "locked" : "failed to lock");
+    assert(timed_out && locked);
+    if (locked)
+      busy.unlock();
+  });
+
+  run();
+  dbg("Semaphore max inside %d (3), rw conflicts %d (0), queue sum %d (5050)\n", max_inside, rw_conflicts, sum);
+  assert(rw_conflicts == 0);
+}
+
 // ----------------------------------------------------------
 void sample_sync() {
+  test_mutex_vs_channel();
+  test_locks();
   test_download_in_parallel();
 }
@@ -0,0 +1,197 @@
+#include <thread>
+#include <atomic>
+#include "sample.h"
+
+using namespace Coroutines;
+
+// ---------------------------------------------------------
+// Some cpu work to do between yields
+static uint64_t doSomeWork(uint64_t seed, int niters) {
+  for (int i = 0; i < niters; ++i)
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return seed;
+}
+
+// ---------------------------------------------------------
+// Measures how many work slices per second we run when using 1..N threads
+void test_threads_scaling() {
+  const int num_coros = 256;
+  const int num_slices = 200;
+  const int work_per_slice = 20000;
+
+  int max_threads = (int)std::thread::hardware_concurrency();
+  if (max_threads < 1)
+    max_threads = 1;
+
+  double base_rate = 0.0;
+  for (int nthreads = 1; nthreads <= max_threads; ++nthreads) {
+    std::atomic<uint64_t> checksum(0);
+
+    TScopedTime tm;
+    for (int i = 0; i < num_coros; ++i) {
+      start([i, &checksum]() {
+        uint64_t v = i;
+        for (int s = 0; s < num_slices; ++s) {
+          v = doSomeWork(v, work_per_slice);
+          yield();
+        }
+        checksum += v;
+      });
+    }
+    runInThreads(nthreads);
+    double secs = std::chrono::duration<double>(tm.elapsed()).count();
+
+    double rate = (num_coros * num_slices) / secs;
+    if (nthreads == 1)
+      base_rate = rate;
+    printf("threads:%2d slices/sec:%10.0f speedup:%5.2fx checksum:%016llx\n"
+      , nthreads, rate, rate / base_rate, (unsigned long long)checksum.load());
+  }
+}
+
+// ---------------------------------------------------------
+// Producers and consumers in different threads sharing a channel.
+void test_threads_channels() {
+  const int num_producers = 4;
+  const int num_consumers = 4;
+  const int num_items = 10000;
+
+  std::atomic<uint64_t> total_consumed(0);
+  std::atomic<int>      num_consumed(0);
+
+  auto items = TTypedChannel<int>::create(64);
+
+  std::vector<THandle> producers;
+  for (int p = 0; p < num_producers; ++p) {
+    producers.push_back(start([items]() {
+      for (int i = 1; i <= num_items; ++i)
+        items << i;
+    }));
+  }
+
+  // Close the channel once all the producers are done
+  start([items, producers]() {
+    for (auto h : producers)
+      wait(h);
+    close(items);
+  });
+
+  for (int c = 0; c < num_consumers; ++c) {
+    start([items, &total_consumed, &num_consumed]() {
+      int v;
+      while (v << items) {
+        total_consumed += v;
+        ++num_consumed;
+      }
+    });
+  }
+
+  runInThreads(4);
+
+  uint64_t expected = (uint64_t)num_producers * num_items * (num_items + 1) / 2;
+  printf("Consumed %d items. Sum %llu (expected %llu)\n"
+    , num_consumed.load(), (unsigned long long)total_consumed.load(), (unsigned long long)expected);
+  assert(total_consumed == expected);
+}
+
+// ---------------------------------------------------------
+// Plain threads (think of network threads) feeding coroutines in the
+// worker threads through a TMPMCChannel, which does not need the sched lock
+void test_threads_mpmc(int nworkers) {
+  const int num_feeders = 2;
+  const int num_consumers = 8;
+  const int num_items = 100000;
+
+  std::atomic<uint64_t> total_consumed(0);
+  std::atomic<int>      num_consumed(0);
+
+  auto items = TMPMCChannel<int>::create(256);
+
+  for (int c = 0; c < num_consumers; ++c) {
+    start([items, &total_consumed, &num_consumed]() {
+      int v;
+      while (v << items) {
+        total_consumed += v;
+        ++num_consumed;
+      }
+    });
+  }
+
+  TScopedTime tm;
+  std::vector<std::thread> feeders;
+  std::atomic<int> num_feeders_alive(num_feeders);
+  for (int f = 0; f < num_feeders; ++f) {
+    feeders.emplace_back([items, &num_feeders_alive]() {
+      for (int i = 1; i <= num_items; ++i)
+        items << i;
+      // The last one closes the channel
+      if (--num_feeders_alive == 0)
+        items.close();
+    });
+  }
+
+  if (nworkers > 1)
+    runInThreads(nworkers);
+  else
+    run();
+  for (auto& t : feeders)
+    t.join();
+  double secs = std::chrono::duration<double>(tm.elapsed()).count();
+
+  uint64_t expected = (uint64_t)num_feeders * num_items * (num_items + 1) / 2;
+  printf("Workers:%d Consumed %d items in %.3fs. Sum %llu (expected %llu)\n"
+    , nworkers, num_consumed.load(), secs, (unsigned long long)total_consumed.load(), (unsigned long long)expected);
+  assert(total_consumed == expected);
+}
+
+// ---------------------------------------------------------
+// A plain thread creates a channel per item while the loop runs, and the
+// loop creates & destroys its own channels meanwhile
+void test_threads_mpmc_create() {
+  const int num_items = 2000;
+  auto created = TMPMCChannel< TMPMCChannel<int> >::create(16);
+  int sum = 0;
+  bool done = false;
+
+  start([&]() {
+    TMPMCChannel<int> ch;
+    while (ch << created) {
+      int v;
+      if (v << ch)
+        sum += v;
+    }
+    done = true;
+  });
+  start([&]() {
+    while (!done) {
+      auto tmp = TTypedChannel<int>::create(4);
+      destroy(tmp);
+      yield();
+    }
+  });
+
+  std::thread creator([created]() {
+    for (int i = 1; i <= num_items; ++i) {
+      auto ch = TMPMCChannel<int>::create(1);
+      ch << i;
+      ch.close();
+      created << ch;
+    }
+    created.close();
+  });
+
+  run();
+  creator.join();
+  int expected = num_items * (num_items + 1) / 2;
+  printf("Channels created by a plain thread: %d. Sum %d (expected %d)\n", num_items, sum, expected);
+  assert(sum == expected);
+}
+
+// -----------------------------------------------------------
+void sample_threads() {
+  test_threads_mpmc(1);
+  test_threads_mpmc_create();
+  test_threads_mpmc(4);
+  test_threads_channels();
+  test_threads_scaling();
+}
@@ -91,7 +91,7 @@ void test_wait_2_coroutines_with_timeout() {
 
   auto coA = start([]() {basic_wait_time("A", 13 * Time::Second); });
   auto coB = start([]() {basic_wait_time("B", 8 * Time::Second); });
-  dbg("co to wait are %08x %08x (%p %p)\n", coA.asUnsigned(), coB.asUnsigned(), &coA, &coB);
+  dbg("co to wait are %016llx %016llx (%p %p)\n", (unsigned long long)coA.asUnsigned(), (unsigned long long)coB.asUnsigned(), &coA, &coB);
 
   auto co2 = start([coA, coB]() {
     // Get a copy or the input values will be corrupted when co2 goes out of scope
@@ -99,7 +99,7 @@ void test_wait_2_coroutines_with_timeout() {
     THandle tcoB = coB;
     int niter = 0;
     while (true) {
-      dbg("co2 iter %d %08x %08x (%p %p)\n", niter, coA.asUnsigned(), coB.asUnsigned(), &coA, &coB);
+      dbg("co2 iter %d %016llx %016llx (%p %p)\n", niter, (unsigned long long)coA.asUnsigned(), (unsigned long long)coB.asUnsigned(), &coA, &coB);
       ++niter;
       int n = 0;
       TWatchedEvent evts[3];
@@ -187,8 +187,174 @@ void test_user_events() {
 
 }
 
+// ---------------------------------------------------------
+// Many coroutines waiting for a level. Polling evaluates all the conditions
+// in each loop, while waitUntil evaluates them when the level changes
+void test_wait_until() {
+  TSimpleDemo demo("test_wait_until");
+  const int num_waiters = 1000;
+  const int max_level = 50;
+
+  for (int use_signals = 0; use_signals < 2; ++use_signals) {
+    int level = 0;
+    long long num_evals = 0;
+    TEventID level_changed = createEvent();
+
+    for (int i = 0; i < num_waiters; ++i) {
+      int target = 1 + i % max_level;
+      start([&, target, use_signals]() {
+        auto reached = [&]() {
+          ++num_evals;
+          return level >= target;
+        };
+        if (use_signals)
+          waitUntil(reached, { TWatchedEvent(level_changed) });
+        else
+          wait([&]() { return !reached(); });
+      });
+    }
+
+    auto loops_at_start = getNumLoops();
+    start([&]() {
+      while (level < max_level) {
+        wait(Time::MilliSecond);
+        ++level;
+        setEvent(level_changed);
+      }
+    });
+    run();
+    dbg("%-8s %8lld evaluations in %d loops\n", use_signals ? "signals" : "polling", num_evals, (int)(getNumLoops() - loops_at_start));
+    destroyEvent(level_changed);
+  }
+
+  // A timeout ends the wait even if the condition is never true
+  start([]() {
+    TEventID never_set = createEvent();
+    bool ok = waitUntil([]() { return false; }, { TWatchedEvent(never_set) }, 10 * Time::MilliSecond);
+    destroyEvent(never_set);
+    dbg("waitUntil %s\n", ok ? "did not time out" : "timed out as expected");
+    assert(!ok);
+  });
+}
+
+// ---------------------------------------------------------
+// Channels as sources of waitUntil. A closed channel will not signal again,
+// so the wait ends instead of sleeping forever
+void test_wait_until_channels() {
+  TSimpleDemo demo("test_wait_until_channels");
+
+  auto ch = TTypedChannel<int>::create(4);
+  int pushed = 0;
+  start([&]() {
+    bool ok = waitUntil([&]() { return pushed >= 3; }, { canRead(ch) });
+    dbg("waitUntil on a channel %s after %d pushes\n", ok ? "ends" : "failed", pushed);
+    assert(ok);
+  });
+  start([&]() {
+    for (int i = 0; i < 3; ++i) {
+      wait(Time::MilliSecond);
+      ++pushed;
+      ch << i;
+    }
+  });
+
+  start([]() {
+    // Closed, but still holding data
+    auto with_data = TTypedChannel<int>::create(4);
+    with_data << 1;
+    close(with_data);
+    bool ok = waitUntil([]() { return false; }, { canRead(with_data) });
+    dbg("waitUntil on a closed channel with data returns %d\n", ok);
+    assert(!ok);
+
+    // Closed and drained
+    auto drained = TTypedChannel<int>::create(4);
+    close(drained);
+    ok = waitUntil([]() { return false; }, { canRead(drained), canWrite(drained) });
+    dbg("waitUntil on a closed & drained channel returns %d\n", ok);
+    assert(!ok);
+    destroy(with_data);
+    destroy(drained);
+  });
+
+  // More sources than the ones kept in the stack
+  start([]() {
+    std::vector< TWatchedEvent > sources;
+    for (int i = 0; i < 12; ++i)
+      sources.push_back(TWatchedEvent(createEvent()));
+    bool ok = waitUntil([]() { return false; }, sources.data(), (int)sources.size(), 10 * Time::MilliSecond);
+    dbg("waitUntil with %d sources returns %d\n", (int)sources.size(), ok);
+    assert(!ok);
+    for (auto& we : sources)
+      destroyEvent(we.user_event.event_id);
+  });
+}
+
+// ---------------------------------------------------------
+// Which coroutines use the loop, and what the others are waiting for.
+// Requires building the library with COROUTINES_PROFILING
+void test_profiling() {
+  TSimpleDemo demo("test_profiling");
+  bool done = false;
+  auto ch = TTypedChannel<int>::create(4);
+
+  // Burns cpu between yields
+  start([&]() {
+    volatile double acc = 0;
+    while (!done) {
+      for (int i = 0; i < 20000; ++i)
+        acc = acc + i * 0.5;
+      yield();
+    }
+  });
+  // Sleeps most of the time
+  for (int i = 0; i < 3; ++i) {
+    start([&, i]() {
+      while (!done)
+        wait((i + 1) * Time::MilliSecond);
+    });
+  }
+  // Waits for data from a producer
+  start([&]() {
+    int v;
+    while (v << ch) { }
+  });
+  start([&]() {
+    int n = 0;
+    while (!done) {
+      ch << n++;
+      wait(2 * Time::MilliSecond);
+    }
+  });
+
+  start([&]() {
+    wait(50 * Time::MilliSecond);
+    auto show = [](const char* title, const std::vector<TCoroStats>& top) {
+      dbg("Top by %s\n", title);
+      for (auto& s : top)
+        dbg("  %02d.%02d running %6d us switches %5d waiting %6d us (timeouts %6d us, channels %6d us)\n",
+          s.h.id, s.h.age,
+          Time::asMicroSeconds(s.running_time), (int)s.num_switches,
+          Time::asMicroSeconds(s.totalWaitingTime()),
+          Time::asMicroSeconds(s.waiting_time[EVT_TIMEOUT]),
+          Time::asMicroSeconds(s.waiting_time[EVT_CHANNEL_CAN_PULL]));
+    };
+    auto top = topCoroutines(METRIC_RUNNING_TIME, 3);
+    if (top.empty())
+      dbg("Build with COROUTINES_PROFILING to get the stats\n");
+    show("running time", top);
+    show("switches", topCoroutines(METRIC_NUM_SWITCHES, 3));
+    show("waiting on channels", topCoroutines(METRIC_WAITING_TIME, 3, EVT_CHANNEL_CAN_PULL));
+    done = true;
+    close(ch);
+  });
+}
+
 // ----------------------------------------------------------
 void sample_wait() {
+  test_profiling();
+  test_wait_until();
+  test_wait_until_channels();
   test_user_events();
   test_yield();
   test_wait_time();